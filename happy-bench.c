@@ -0,0 +1,1170 @@
+/*
+ * happy-bench.c --
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of the Leone Project or Jacobs University Bremen.
+ */
+
+/*
+ * End-to-end benchmark for happy. We start listeners on the loopback
+ * interface, generate a target file with synthetic endpoints, run
+ * happy against it and report throughput, resource usage and the
+ * measurement error relative to what the listeners injected.
+ *
+ * Endpoints come in three classes:
+ *
+ *   open	127.0.0.1 and ::1, served by a listener that accepts
+ *		connections (optionally after an accept delay)
+ *   refused	127.0.0.2, nothing listens there, connect() gets a RST
+ *   blackhole	127.0.0.3, a listener whose accept queue is kept full
+ *		so that the kernel silently drops all further SYNs
+ *
+ * For open and refused endpoints the expected result is an (almost)
+ * zero connection setup time; for black-holed endpoints it is the
+ * timeout. Any deviation is the measurement error of happy itself.
+ *
+ * With -D, we instead generate names that are served by a local
+ * happy-dnsstub and measure the name resolution rate of happy with
+ * and without -a, entirely offline.
+ *
+ * With -W, the open listeners accept connections but never read or
+ * answer, and happy pumps them with -b -w 1. Every open endpoint must
+ * be given up after the pump timeout; happy is killed and the
+ * benchmark fails if it takes much longer than that.
+ */
+
+#define _POSIX_C_SOURCE 2
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <libgen.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#endif
+
+static const char *progname = "happy-bench";
+
+#define CLASS_OPEN	0
+#define CLASS_REFUSED	1
+#define CLASS_BLACKHOLE	2
+#define CLASS_MAX	3
+
+static const char *class_names[CLASS_MAX] = {
+    "open", "refused", "blackhole"
+};
+
+static const char *class_addrs[CLASS_MAX] = {
+    "127.0.0.1", "127.0.0.2", "127.0.0.3"
+};
+
+typedef struct stats {
+    unsigned long endpoints;
+    unsigned long samples;
+    unsigned long ok;
+    unsigned long failed;
+    unsigned long timedout;
+    double err_sum;			/* in us */
+    double err_max;			/* in us */
+} stats_t;
+
+static unsigned int nendpoints = 1000;
+static unsigned int accept_delay = 0;	/* in ms */
+static unsigned int refuse_pct = 0;
+static unsigned int blackhole_pct = 0;
+static int timeout = 2000;		/* in ms */
+static int backlog = SOMAXCONN;
+
+/*
+ * TCP Fast Open results (-F) of the open endpoints, per address
+ * family. Times are sums of the average times to first byte in us.
+ */
+
+typedef struct fostats {
+    unsigned long endpoints;
+    unsigned long acked;
+    double plain_sum;
+    double tfo_sum;
+} fostats_t;
+
+static int fastopen = 0;
+static fostats_t fostats[2];
+
+/*
+ * TLS handshake results (-T) of the open endpoints, per address
+ * family and kind of handshake (full or resumed). Times are in us.
+ */
+
+typedef struct tlsstats {
+    unsigned long count[2];
+    double sum[2];
+} tlsstats_t;
+
+static char *tls = NULL;
+static tlsstats_t tlsstats[2];
+#ifdef HAVE_OPENSSL
+static SSL_CTX *tls_ctx = NULL;
+#endif
+
+/*
+ * Upload results (-U) of happy, per address family. The throughput
+ * is the sum over the endpoints in bytes/ms.
+ */
+
+typedef struct upstats {
+    unsigned long endpoints;
+    double sum;
+} upstats_t;
+
+#define SINK_MAX	256
+
+static int upload = 0;
+static upstats_t upstats[2];
+
+/*
+ * Silent peers (-W). happy pumps each open endpoint for at most its
+ * default pump timeout; the deadline kills happy if it hangs.
+ */
+
+#define PUMP_TIMEOUT	2		/* in s, the default of happy */
+
+static int silent = 0;
+static unsigned int deadline = 0;	/* in s, 0 for none */
+static unsigned long pumped = 0;	/* PUMP lines of happy */
+
+static unsigned int chain_depth = 1;
+static unsigned int dns_latency = 0;	/* in ms */
+
+/*
+ * A calloc() that exits if we run out of memory.
+ */
+
+static void*
+xcalloc(size_t nmemb, size_t size)
+{
+    void *p = calloc(nmemb, size);
+    if (!p) {
+        fprintf(stderr, "%s: memory allocation failure\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ * Parse a non-negative number given as the argument of an option and
+ * exit with an error message if it is malformed.
+ */
+
+static unsigned int
+number(int c, const char *arg, unsigned int max)
+{
+    char *endptr;
+    long num = strtol(arg, &endptr, 10);
+
+    if (num < 0 || num > max || *endptr != '\0') {
+        fprintf(stderr, "%s: invalid argument '%s' for option -%c\n",
+                progname, arg, c);
+        exit(EXIT_FAILURE);
+    }
+    return num;
+}
+
+/*
+ * Create a listening TCP socket bound to the given loopback address
+ * and port. A port of 0 lets the kernel choose a port; the port
+ * actually used is returned in *port. Returns -1 if the address is
+ * not available on this host (e.g., no IPv6).
+ */
+
+static int
+listener(const char *addr, unsigned short *port, int qlen)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    int fd, one = 1;
+
+    memset(&ss, 0, sizeof(ss));
+    if (strchr(addr, ':')) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(*port);
+        (void) inet_pton(AF_INET6, addr, &sin6->sin6_addr);
+        sslen = sizeof(*sin6);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(*port);
+        (void) inet_pton(AF_INET, addr, &sin->sin_addr);
+        sslen = sizeof(*sin);
+    }
+
+    fd = socket(ss.ss_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef TCP_FASTOPEN
+    if (fastopen && qlen) {
+        (void) setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen));
+    }
+#endif
+    if (ss.ss_family == AF_INET6) {
+        (void) setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+    }
+    if (bind(fd, (struct sockaddr *) &ss, sslen) == -1
+        || listen(fd, qlen) == -1) {
+        (void) close(fd);
+        return -1;
+    }
+    if (getsockname(fd, (struct sockaddr *) &ss, &sslen) == 0) {
+        *port = ntohs(((struct sockaddr_in *) &ss)->sin_port);
+    }
+    return fd;
+}
+
+/*
+ * Fill the accept queue of the black hole listener. With a backlog of
+ * zero, the kernel queues a single connection and drops all further
+ * SYNs as long as nobody accepts it.
+ */
+
+static int
+blackhole(unsigned short port)
+{
+    struct sockaddr_in sin;
+    int fd;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    (void) inet_pton(AF_INET, class_addrs[CLASS_BLACKHOLE], &sin.sin_addr);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        fprintf(stderr, "%s: blackhole: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+/*
+ * Answer a request on an accepted connection (-F). The request may
+ * have arrived with the SYN already; we respond to whatever arrives
+ * first and give up if nothing arrives within a second.
+ */
+
+static void
+respond(int fd)
+{
+    static const char response[] =
+        "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    struct timeval tv = { 1, 0 };
+    char buf[1024];
+
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (recv(fd, buf, sizeof(buf), 0) > 0) {
+        (void) send(fd, response, sizeof(response) - 1, MSG_NOSIGNAL);
+    }
+}
+
+#ifdef HAVE_OPENSSL
+
+/*
+ * Set up the server side TLS context with a freshly generated
+ * self-signed certificate. Session tickets are enabled (the default)
+ * so that clients can resume sessions.
+ */
+
+static void
+tls_setup(void)
+{
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *kctx;
+    X509 *crt;
+
+    kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (! kctx || EVP_PKEY_keygen_init(kctx) <= 0
+        || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx,
+                                                  NID_X9_62_prime256v1) <= 0
+        || EVP_PKEY_keygen(kctx, &key) <= 0) {
+        fprintf(stderr, "%s: keygen: %s\n", progname,
+                ERR_error_string(ERR_get_error(), NULL));
+        exit(EXIT_FAILURE);
+    }
+    EVP_PKEY_CTX_free(kctx);
+
+    crt = X509_new();
+    X509_set_version(crt, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(crt), 1);
+    X509_gmtime_adj(X509_getm_notBefore(crt), 0);
+    X509_gmtime_adj(X509_getm_notAfter(crt), 86400);
+    X509_set_pubkey(crt, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(crt), "CN", MBSTRING_ASC,
+                               (const unsigned char *) "happy-bench", -1, -1, 0);
+    X509_set_issuer_name(crt, X509_get_subject_name(crt));
+    X509_sign(crt, key, EVP_sha256());
+
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (! tls_ctx || SSL_CTX_use_certificate(tls_ctx, crt) != 1
+        || SSL_CTX_use_PrivateKey(tls_ctx, key) != 1) {
+        fprintf(stderr, "%s: SSL_CTX: %s\n", progname,
+                ERR_error_string(ERR_get_error(), NULL));
+        exit(EXIT_FAILURE);
+    }
+    X509_free(crt);
+    EVP_PKEY_free(key);
+}
+
+/*
+ * Run the server side of a TLS handshake on an accepted connection
+ * (-T). Clients that do not complete the handshake within a second
+ * are given up on.
+ */
+
+static void
+handshake(int fd)
+{
+    struct timeval tv = { 1, 0 };
+    SSL *ssl;
+
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ssl = SSL_new(tls_ctx);
+    if (! ssl) {
+        return;
+    }
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) == 1) {
+        (void) SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+}
+
+#endif
+
+/*
+ * Read and discard the data of an uploading client (-U). Returns -1
+ * once the client has closed the connection.
+ */
+
+static int
+sink(int fd)
+{
+    static char buf[65536];
+    ssize_t n;
+
+    n = read(fd, buf, sizeof(buf));
+    if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN)) {
+        (void) close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Serve the open listeners until we get killed. Each connection is
+ * accepted after the configured accept delay and closed right away
+ * (after answering the request with -F). A large accept delay
+ * therefore builds up the accept queue until the kernel starts to
+ * drop SYNs. With -U, connections are kept and everything they send
+ * is discarded until the client closes them. With -W, connections
+ * are kept and left alone until we get killed.
+ */
+
+static void
+serve(int *fds, int nfds)
+{
+    struct pollfd pfd[2 + SINK_MAX];
+    int i, fd, nlisten = nfds;
+
+    /* clients may go away in the middle of a TLS handshake */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < nfds; i++) {
+        pfd[i].fd = fds[i];
+        pfd[i].events = POLLIN;
+    }
+
+    while (1) {
+        if (poll(pfd, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "%s: poll: %s\n", progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (i = nfds - 1; i >= nlisten; i--) {
+            if (pfd[i].revents && sink(pfd[i].fd) == -1) {
+                pfd[i] = pfd[--nfds];
+            }
+        }
+        for (i = 0; i < nlisten; i++) {
+            if (! (pfd[i].revents & POLLIN)) {
+                continue;
+            }
+            if (accept_delay) {
+                (void) usleep(accept_delay * 1000);
+            }
+            fd = accept(pfd[i].fd, NULL, NULL);
+            if (fd != -1 && silent) {
+                continue;
+            }
+            if (fd != -1 && upload && nfds < 2 + SINK_MAX) {
+                pfd[nfds].fd = fd;
+                pfd[nfds].events = POLLIN;
+                pfd[nfds++].revents = 0;
+            } else if (fd != -1) {
+                if (fastopen) {
+                    respond(fd);
+                }
+#ifdef HAVE_OPENSSL
+                if (tls) {
+                    handshake(fd);
+                }
+#endif
+                (void) close(fd);
+            }
+        }
+    }
+}
+
+/*
+ * Write the target file. Endpoints are assigned to classes so that
+ * the requested percentages are met; open endpoints alternate
+ * between IPv4 and IPv6 if IPv6 is available.
+ */
+
+static void
+generate(FILE *f, int v6)
+{
+    unsigned int i;
+    int c;
+
+    for (i = 0; i < nendpoints; i++) {
+        if (i % 100 < refuse_pct) {
+            c = CLASS_REFUSED;
+        } else if (i % 100 >= 100 - blackhole_pct) {
+            c = CLASS_BLACKHOLE;
+        } else {
+            c = CLASS_OPEN;
+        }
+        if (c == CLASS_OPEN && v6 && (i & 1)) {
+            fprintf(f, "::1\n");
+        } else {
+            fprintf(f, "%s\n", class_addrs[c]);
+        }
+    }
+}
+
+/*
+ * Write the target file for the name resolution benchmark. All names
+ * are fully qualified so that no search domains get involved.
+ */
+
+static void
+generate_names(FILE *f)
+{
+    unsigned int i;
+
+    for (i = 0; i < nendpoints; i++) {
+        fprintf(f, "h%u.bench.invalid.\n", i);
+    }
+}
+
+/*
+ * Map an endpoint address reported by happy back to its class.
+ */
+
+static int
+classify(const char *addr)
+{
+    int c;
+
+    if (strcmp(addr, "::1") == 0) {
+        return CLASS_OPEN;
+    }
+    for (c = 0; c < CLASS_MAX; c++) {
+        if (strcmp(addr, class_addrs[c]) == 0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Account a TCP Fast Open result line of happy (-F) against the
+ * address family of the endpoint.
+ */
+
+static void
+account_fastopen(char *line)
+{
+    char *fields[11], *p, *tok;
+    int i;
+    fostats_t *fs;
+
+    for (i = 0, p = line; i < 11 && (tok = strsep(&p, ";")); i++) {
+        fields[i] = tok;
+    }
+    if (i < 11 || strcmp(fields[2], "OK") != 0
+        || classify(fields[5]) != CLASS_OPEN) {
+        return;
+    }
+    fs = &fostats[strchr(fields[5], ':') != NULL];
+    fs->endpoints++;
+    fs->plain_sum += strtol(fields[7], NULL, 10);
+    fs->tfo_sum += strtol(fields[8], NULL, 10);
+    fs->acked += strcmp(fields[6], "acked") == 0;
+}
+
+/*
+ * Account a TLS result line of happy (-T) against the address family
+ * of the endpoint. Resumed handshakes carry an 'r' suffix.
+ */
+
+static void
+account_tls(char *line)
+{
+    char *fields[7], *p, *tok, *end;
+    int i;
+    long v;
+    tlsstats_t *ts;
+
+    for (i = 0, p = line; i < 7 && (tok = strsep(&p, ";")); i++) {
+        fields[i] = tok;
+    }
+    if (i < 7 || classify(fields[5]) != CLASS_OPEN) {
+        return;
+    }
+    ts = &tlsstats[strchr(fields[5], ':') != NULL];
+    while (p && (tok = strsep(&p, ";"))) {
+        v = strtol(tok, &end, 10);
+        if (v >= 0) {
+            ts->count[*end == 'r']++;
+            ts->sum[*end == 'r'] += v;
+        }
+    }
+}
+
+/*
+ * Account an upload result line of happy (-U), one per address family.
+ */
+
+static void
+account_upload(char *line)
+{
+    char *fields[6], *p, *tok;
+    int i;
+    upstats_t *us;
+
+    for (i = 0, p = line; i < 6 && (tok = strsep(&p, ";")); i++) {
+        fields[i] = tok;
+    }
+    if (i < 6 || strcmp(fields[2], "OK") != 0) {
+        return;
+    }
+    us = &upstats[strcmp(fields[3], "IPv6") == 0];
+    us->endpoints += strtol(fields[4], NULL, 10);
+    us->sum += strtod(fields[5], NULL);
+}
+
+/*
+ * Parse the machine readable output of happy and account every
+ * sample against the expectation for its endpoint class.
+ */
+
+static void
+account(FILE *in, stats_t *stats)
+{
+    char line[8192], *fields[8], *p, *tok;
+    int i, c;
+    long v;
+    double err;
+
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "TFO.", 4) == 0) {
+            account_fastopen(line);
+            continue;
+        }
+        if (strncmp(line, "TLS.", 4) == 0) {
+            account_tls(line);
+            continue;
+        }
+        if (strncmp(line, "UPLOAD.", 7) == 0) {
+            account_upload(line);
+            continue;
+        }
+        if (strncmp(line, "PUMP.", 5) == 0) {
+            pumped++;
+            continue;
+        }
+        if (strncmp(line, "HAPPY.", 6) != 0) {
+            continue;
+        }
+        for (i = 0, p = line; i < 6 && (tok = strsep(&p, ";")); i++) {
+            fields[i] = tok;
+        }
+        if (i < 6 || (c = classify(fields[5])) < 0) {
+            continue;
+        }
+        stats[c].endpoints++;
+        while (p && (tok = strsep(&p, ";"))) {
+            v = strtol(tok, NULL, 10);
+            stats[c].samples++;
+            if (v >= 0) {
+                stats[c].ok++;
+                err = v;
+            } else if (-v >= timeout * 1000) {
+                stats[c].timedout++;
+                err = c == CLASS_BLACKHOLE ? -v - timeout * 1000.0 : -v;
+            } else {
+                stats[c].failed++;
+                err = -v;
+            }
+            stats[c].err_sum += err;
+            if (err > stats[c].err_max) {
+                stats[c].err_max = err;
+            }
+        }
+    }
+}
+
+/*
+ * Report the benchmark results for human readers.
+ */
+
+static void
+report(stats_t *stats, struct timespec *wall, struct rusage *ru,
+       unsigned short port)
+{
+    int c;
+    double secs, cpu;
+    unsigned long probes = 0;
+
+    for (c = 0; c < CLASS_MAX; c++) {
+        probes += stats[c].samples;
+    }
+    secs = wall->tv_sec + wall->tv_nsec / 1e9;
+    cpu = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6
+        + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+
+    printf("endpoints  %u (port %u, accept delay %u ms, "
+           "refused %u%%, blackhole %u%%)\n",
+           nendpoints, port, accept_delay, refuse_pct, blackhole_pct);
+    printf("probes     %lu\n", probes);
+    printf("wall       %.3f s\n", secs);
+    printf("rate       %.1f probes/s\n", secs > 0 ? probes / secs : 0.0);
+    printf("cpu        %.3f s (user %ld.%06ld, sys %ld.%06ld)\n", cpu,
+           (long) ru->ru_utime.tv_sec, (long) ru->ru_utime.tv_usec,
+           (long) ru->ru_stime.tv_sec, (long) ru->ru_stime.tv_usec);
+    printf("maxrss     %ld KiB\n", ru->ru_maxrss);
+    printf("\n%-10s %9s %9s %9s %9s %9s %12s %12s\n",
+           "class", "endpoints", "samples", "ok", "failed", "timeout",
+           "err-avg(ms)", "err-max(ms)");
+    for (c = 0; c < CLASS_MAX; c++) {
+        printf("%-10s %9lu %9lu %9lu %9lu %9lu %12.3f %12.3f\n",
+               class_names[c], stats[c].endpoints, stats[c].samples,
+               stats[c].ok, stats[c].failed, stats[c].timedout,
+               stats[c].samples ? stats[c].err_sum / stats[c].samples / 1000 : 0,
+               stats[c].err_max / 1000);
+    }
+
+    if (tls) {
+        printf("\n%-10s %9s %12s %9s %12s\n",
+               "tls", "full", "full(ms)", "resumed", "resumed(ms)");
+        for (c = 0; c < 2; c++) {
+            tlsstats_t *ts = &tlsstats[c];
+            printf("%-10s %9lu %12.3f %9lu %12.3f\n",
+                   c ? "ipv6" : "ipv4",
+                   ts->count[0],
+                   ts->count[0] ? ts->sum[0] / ts->count[0] / 1000 : 0,
+                   ts->count[1],
+                   ts->count[1] ? ts->sum[1] / ts->count[1] / 1000 : 0);
+        }
+    }
+
+    if (silent) {
+        printf("\n%-10s %9s %12s %12s\n",
+               "silent", "endpoints", "wall(s)", "pump(s)");
+        printf("%-10s %9lu %12.3f %12lu\n", "pumped",
+               pumped, secs, pumped * PUMP_TIMEOUT);
+    }
+
+    if (upload) {
+        printf("\n%-10s %9s %12s %12s\n",
+               "upload", "endpoints", "total(MB/s)", "avg(MB/s)");
+        for (c = 0; c < 2; c++) {
+            upstats_t *us = &upstats[c];
+            printf("%-10s %9lu %12.3f %12.3f\n",
+                   c ? "ipv6" : "ipv4", us->endpoints, us->sum / 1000,
+                   us->endpoints ? us->sum / us->endpoints / 1000 : 0);
+        }
+    }
+
+    if (! fastopen) {
+        return;
+    }
+    printf("\n%-10s %9s %9s %12s %12s %12s\n",
+           "tfo", "endpoints", "acked", "plain(ms)", "tfo(ms)", "saved(ms)");
+    for (c = 0; c < 2; c++) {
+        fostats_t *fs = &fostats[c];
+        double n = fs->endpoints ? fs->endpoints * 1000.0 : 1;
+        printf("%-10s %9lu %9lu %12.3f %12.3f %12.3f\n",
+               c ? "ipv6" : "ipv4", fs->endpoints, fs->acked,
+               fs->plain_sum / n, fs->tfo_sum / n,
+               (fs->plain_sum - fs->tfo_sum) / n);
+    }
+}
+
+/*
+ * Report the results of the name resolution benchmark. The first run
+ * resolves every name and probes it once, the second run does the
+ * same with -a, so the difference is the cost of the -a mode.
+ */
+
+static void
+report_dns(struct timespec *wall, struct rusage *ru)
+{
+    int r;
+    double secs[2], cpu[2];
+    static const char *runs[2] = { "resolve", "resolve -a" };
+
+    for (r = 0; r < 2; r++) {
+        secs[r] = wall[r].tv_sec + wall[r].tv_nsec / 1e9;
+        cpu[r] = ru[r].ru_utime.tv_sec + ru[r].ru_utime.tv_usec / 1e6
+            + ru[r].ru_stime.tv_sec + ru[r].ru_stime.tv_usec / 1e6;
+    }
+
+    printf("names      %u (chain depth %u, latency %u ms)\n",
+           nendpoints, chain_depth, dns_latency);
+    printf("\n%-12s %10s %12s %10s %10s\n",
+           "run", "wall(s)", "names/s", "cpu(s)", "maxrss(KiB)");
+    for (r = 0; r < 2; r++) {
+        printf("%-12s %10.3f %12.1f %10.3f %10ld\n", runs[r], secs[r],
+               secs[r] > 0 ? nendpoints / secs[r] : 0.0, cpu[r],
+               ru[r].ru_maxrss);
+    }
+    printf("\n-a cost    %.1f us/name wall, %.1f us/name cpu\n",
+           (secs[1] - secs[0]) * 1e6 / nendpoints,
+           (cpu[1] - cpu[0]) * 1e6 / nendpoints);
+}
+
+/*
+ * Start a helper program with its standard output connected to a
+ * pipe. The read end of the pipe is returned in *out. A non-zero
+ * limit kills the program with SIGALRM after that many seconds.
+ */
+
+static pid_t
+spawn(char **av, int *out, unsigned int limit)
+{
+    int pfd[2];
+    pid_t pid;
+
+    if (pipe(pfd) == -1) {
+        fprintf(stderr, "%s: pipe: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "%s: fork: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        (void) dup2(pfd[1], STDOUT_FILENO);
+        (void) close(pfd[0]);
+        (void) close(pfd[1]);
+        if (limit) {
+            (void) alarm(limit);
+        }
+        execv(av[0], av);
+        fprintf(stderr, "%s: exec %s: %s\n", progname, av[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    (void) close(pfd[1]);
+    *out = pfd[0];
+    return pid;
+}
+
+/*
+ * Run happy once with the given arguments, account its output and
+ * return its resource usage and the wall clock time it took. Returns
+ * -1 if happy had to be killed at the deadline.
+ */
+
+static int
+run(char **hargv, stats_t *stats, struct rusage *ru, struct timespec *wall)
+{
+    int fd, status;
+    pid_t child;
+    FILE *in;
+    struct timespec t0, t1;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+    child = spawn(hargv, &fd, deadline);
+
+    in = fdopen(fd, "r");
+    account(in, stats);
+    fclose(in);
+
+    if (wait4(child, &status, 0, ru) == -1) {
+        fprintf(stderr, "%s: wait4: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+        fprintf(stderr, "%s: %s did not finish within %u s\n",
+                progname, hargv[0], deadline);
+        return -1;
+    }
+    if (! WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "%s: %s did not exit successfully\n",
+                progname, hargv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    wall->tv_sec = t1.tv_sec - t0.tv_sec;
+    wall->tv_nsec = t1.tv_nsec - t0.tv_nsec;
+    if (wall->tv_nsec < 0) {
+        wall->tv_sec--;
+        wall->tv_nsec += 1000000000;
+    }
+    return 0;
+}
+
+/*
+ * Start the stub DNS responder and return the name server spec (in
+ * the format expected by happy -r) it announces on its output.
+ */
+
+static pid_t
+stub(const char *dir, char *ns, size_t nslen)
+{
+    char *sargv[8], depth[16], latency[16];
+    int fd, n;
+    pid_t pid;
+
+    snprintf(depth, sizeof(depth), "%u", chain_depth);
+    snprintf(latency, sizeof(latency), "%u", dns_latency);
+    if (asprintf(&sargv[0], "%s/happy-dnsstub", dir) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    sargv[1] = "-p";
+    sargv[2] = "0";
+    sargv[3] = "-c";
+    sargv[4] = depth;
+    sargv[5] = "-l";
+    sargv[6] = latency;
+    sargv[7] = NULL;
+
+    pid = spawn(sargv, &fd, 0);
+    n = read(fd, ns, nslen - 1);
+    if (n <= 0) {
+        fprintf(stderr, "%s: %s did not start\n", progname, sargv[0]);
+        exit(EXIT_FAILURE);
+    }
+    ns[n] = 0;
+    ns[strcspn(ns, "\n")] = 0;
+    (void) close(fd);
+    free(sargv[0]);
+    return pid;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c, i, rc, nfds = 0, fds[2], bh = -1, bhc = -1, v6, dns = 0;
+    unsigned short port = 0, bhport;
+    char *self = "happy-bench", *happy = NULL, *dir, portstr[8], tostr[16];
+    char ns[64];
+    char template[] = "/tmp/happy-bench-XXXXXX";
+    char **hargv;
+    pid_t server, resolver = 0;
+    FILE *f;
+    stats_t stats[CLASS_MAX];
+    struct timespec wall[2];
+    struct rusage ru[2];
+
+    if (argc > 0) {
+        self = argv[0];
+    }
+
+    while ((c = getopt(argc, argv, "a:c:DFhk:l:L:n:r:t:T:UWx:")) != -1) {
+        switch (c) {
+        case 'a':
+            accept_delay = number(c, optarg, 60000);
+            break;
+        case 'c':
+            chain_depth = number(c, optarg, 32);
+            break;
+        case 'D':
+            dns = 1;
+            break;
+        case 'F':
+            fastopen = 1;
+            break;
+        case 'k':
+            blackhole_pct = number(c, optarg, 100);
+            break;
+        case 'l':
+            backlog = number(c, optarg, 65535);
+            break;
+        case 'L':
+            dns_latency = number(c, optarg, 60000);
+            break;
+        case 'n':
+            nendpoints = number(c, optarg, 10000000);
+            break;
+        case 'r':
+            refuse_pct = number(c, optarg, 100);
+            break;
+        case 't':
+            timeout = number(c, optarg, 3600000);
+            break;
+        case 'T':
+            tls = optarg;
+            break;
+        case 'U':
+            upload = 1;
+            break;
+        case 'W':
+            silent = 1;
+            break;
+        case 'x':
+            happy = optarg;
+            break;
+        case 'h':
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n endpoints] [-a accept-delay] [-r refuse%%] "
+                    "[-k blackhole%%] [-l backlog] [-t timeout] [-x happy] [-F] "
+                    "[-T full|resume] [-U] [-W] "
+                    "[-D [-c depth] [-L latency]] "
+                    "[-- happy-options...]\n", progname);
+            exit(EXIT_FAILURE);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (refuse_pct + blackhole_pct > 100) {
+        fprintf(stderr, "%s: refused and black-holed endpoints exceed 100%%\n",
+                progname);
+        exit(EXIT_FAILURE);
+    }
+    if (dns) {
+        refuse_pct = blackhole_pct = 0;
+    }
+    if (upload && (fastopen || tls)) {
+        fprintf(stderr, "%s: option -U cannot be combined with -F or -T\n",
+                progname);
+        exit(EXIT_FAILURE);
+    }
+    if (silent && (upload || fastopen || tls || dns)) {
+        fprintf(stderr, "%s: option -W cannot be combined with -D, -F, "
+                "-T or -U\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    if (tls) {
+        if (fastopen) {
+            fprintf(stderr, "%s: options -F and -T cannot be combined\n",
+                    progname);
+            exit(EXIT_FAILURE);
+        }
+#ifdef HAVE_OPENSSL
+        tls_setup();
+#else
+        fprintf(stderr, "%s: TLS not supported\n", progname);
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    dir = dirname(strdup(self));
+    if (! happy) {
+        if (asprintf(&happy, "%s/happy", dir) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fds[nfds] = listener(class_addrs[CLASS_OPEN], &port, backlog);
+    if (fds[nfds] == -1) {
+        fprintf(stderr, "%s: listen: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    nfds++;
+    fds[nfds] = listener("::1", &port, backlog);
+    v6 = (fds[nfds] != -1);
+    if (v6) nfds++;
+
+    if (blackhole_pct) {
+        bhport = port;
+        bh = listener(class_addrs[CLASS_BLACKHOLE], &bhport, 0);
+        if (bh == -1) {
+            fprintf(stderr, "%s: listen: %s: %s\n", progname,
+                    class_addrs[CLASS_BLACKHOLE], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        bhc = blackhole(port);
+        (void) fcntl(bh, F_SETFD, FD_CLOEXEC);
+        (void) fcntl(bhc, F_SETFD, FD_CLOEXEC);
+    }
+
+    server = fork();
+    if (server == -1) {
+        fprintf(stderr, "%s: fork: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (server == 0) {
+        serve(fds, nfds);
+        _exit(EXIT_SUCCESS);
+    }
+    for (i = 0; i < nfds; i++) {
+        (void) close(fds[i]);
+    }
+
+    if (dns) {
+        resolver = stub(dir, ns, sizeof(ns));
+    }
+
+    i = mkstemp(template);
+    if (i == -1 || ! (f = fdopen(i, "w"))) {
+        fprintf(stderr, "%s: mkstemp: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (dns) {
+        generate_names(f);
+    } else {
+        generate(f, v6);
+    }
+    fclose(f);
+
+    snprintf(portstr, sizeof(portstr), "%u", port);
+    snprintf(tostr, sizeof(tostr), "%d", timeout);
+    hargv = xcalloc(argc + 16, sizeof(char *));
+    i = 0;
+    hargv[i++] = happy;
+    hargv[i++] = "-m";
+    hargv[i++] = "-p";
+    hargv[i++] = portstr;
+    hargv[i++] = "-t";
+    hargv[i++] = tostr;
+    if (fastopen) {
+        hargv[i++] = "-F";
+    }
+    if (upload) {
+        hargv[i++] = "-U";
+    }
+    if (silent) {
+        /* twice the pump timeout per endpoint leaves room for probing */
+        deadline = 2 * PUMP_TIMEOUT * nendpoints + timeout / 1000 + 10;
+        hargv[i++] = "-b";
+        hargv[i++] = "-w";
+        hargv[i++] = "1";
+    }
+    if (tls) {
+        hargv[i++] = "-T";
+        hargv[i++] = tls;
+    }
+    if (dns) {
+        hargv[i++] = "-r";
+        hargv[i++] = ns;
+        hargv[i++] = "-q";
+        hargv[i++] = "1";
+        hargv[i++] = "-d";
+        hargv[i++] = "0";
+    }
+    for (c = 0; c < argc; c++) {
+        hargv[i++] = argv[c];
+    }
+    hargv[i++] = "-f";
+    hargv[i++] = template;
+
+    memset(stats, 0, sizeof(stats));
+    rc = run(hargv, stats, &ru[0], &wall[0]);
+    if (dns) {
+        /* second run with -a (and -c to keep the probing identical) */
+        memmove(hargv + 3, hargv + 1, (i - 1) * sizeof(char *));
+        hargv[1] = "-a";
+        hargv[2] = "-c";
+        memset(stats, 0, sizeof(stats));
+        rc = run(hargv, stats, &ru[1], &wall[1]);
+    }
+
+    (void) kill(server, SIGTERM);
+    (void) waitpid(server, NULL, 0);
+    if (resolver) {
+        (void) kill(resolver, SIGTERM);
+        (void) waitpid(resolver, NULL, 0);
+    }
+    (void) unlink(template);
+    if (bh != -1) {
+        (void) close(bhc);
+        (void) close(bh);
+    }
+
+    if (rc == -1) {
+        /* only with -W, where the deadline is part of the test */
+        free(hargv);
+        return EXIT_FAILURE;
+    }
+    if (dns) {
+        report_dns(wall, ru);
+    } else {
+        report(stats, &wall[0], &ru[0], port);
+    }
+
+    free(hargv);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,432 @@
+/*
+ * happy-dnsstub.c --
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of the Leone Project or Jacobs University Bremen.
+ */
+
+/*
+ * A stub DNS responder serving synthetic data over UDP. It is used to
+ * benchmark the name resolution code of happy without depending on
+ * the Internet. Every name exists:
+ *
+ *   name		CNAME cname1.name (if the chain depth is > 0)
+ *   cnameN.name	CNAME cname(N+1).name, until N reaches the depth
+ *   (end of chain)	A and AAAA records with the configured addresses
+ *   *.arpa		PTR stub.invalid.
+ *
+ * Queries for A and AAAA records are answered with the whole CNAME
+ * chain, just like a recursive resolver would do. Responses are held
+ * back for the configured latency.
+ */
+
+#define _POSIX_C_SOURCE 2
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+
+static const char *progname = "happy-dnsstub";
+
+#define MAX_PENDING	65536
+#define MAX_PACKET	NS_PACKETSZ
+
+typedef struct pending {
+    struct timeval due;
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
+    unsigned short len;
+    u_char buf[MAX_PACKET];
+} pending_t;
+
+static pending_t *queue;
+static unsigned int qhead = 0, qtail = 0;
+
+static unsigned int latency = 0;	/* in ms */
+static unsigned int depth = 0;
+static unsigned int ttl = 0;
+static struct in_addr addr4;
+static struct in6_addr addr6;
+
+static const char ptrname[] = "stub.invalid";
+
+/*
+ * Append a domain name in wire format to the packet at *p. The name
+ * is given as a dotted string with or without the trailing dot.
+ * Returns the number of bytes written or -1 if it did not fit.
+ */
+
+static int
+put_name(u_char *p, u_char *end, const char *name)
+{
+    u_char *start = p;
+    const char *dot;
+    size_t len;
+
+    while (*name) {
+        dot = strchr(name, '.');
+        len = dot ? (size_t) (dot - name) : strlen(name);
+        if (len == 0 || len > 63 || p + 1 + len >= end) {
+            return -1;
+        }
+        *p++ = len;
+        memcpy(p, name, len);
+        p += len;
+        name += len + (dot ? 1 : 0);
+    }
+    if (p >= end) {
+        return -1;
+    }
+    *p++ = 0;
+    return p - start;
+}
+
+/*
+ * Append a resource record to the packet. Returns the number of bytes
+ * written or -1 if the record did not fit.
+ */
+
+static int
+put_rr(u_char *p, u_char *end, const char *owner, int type,
+       const void *rdata, int rdlen, const char *target)
+{
+    u_char *start = p;
+    int n;
+
+    if ((n = put_name(p, end, owner)) < 0) {
+        return -1;
+    }
+    p += n;
+    if (p + 10 > end) {
+        return -1;
+    }
+    NS_PUT16(type, p);
+    NS_PUT16(ns_c_in, p);
+    NS_PUT32(ttl, p);
+    if (target) {
+        if ((n = put_name(p + 2, end, target)) < 0) {
+            return -1;
+        }
+        NS_PUT16(n, p);
+        p += n;
+    } else {
+        if (p + 2 + rdlen > end) {
+            return -1;
+        }
+        NS_PUT16(rdlen, p);
+        memcpy(p, rdata, rdlen);
+        p += rdlen;
+    }
+    return p - start;
+}
+
+/*
+ * Determine the position of a name in the CNAME chain: 0 for the name
+ * originally queried, N for a name starting with the label cnameN.
+ * The remaining name (without the cnameN label) is returned in *base.
+ */
+
+static unsigned int
+chain_pos(const char *name, const char **base)
+{
+    unsigned int n;
+    char *endptr;
+
+    *base = name;
+    if (strncasecmp(name, "cname", 5) != 0 || ! isdigit((u_char) name[5])) {
+        return 0;
+    }
+    n = strtoul(name + 5, &endptr, 10);
+    if (*endptr != '.') {
+        return 0;
+    }
+    *base = endptr + 1;
+    return n;
+}
+
+/*
+ * Write the name the CNAME at position pos of the chain points to.
+ * Returns -1 if it does not fit, i.e., if it would not be a valid
+ * domain name.
+ */
+
+static int
+cname_target(char *target, size_t len, unsigned int pos, const char *base)
+{
+    int n = snprintf(target, len, "cname%u.%s", pos + 1, base);
+
+    return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+/*
+ * Build the response to the query in q (of length qlen) into r.
+ * Returns the length of the response or -1 if the query is not
+ * something we want to answer at all.
+ */
+
+static int
+respond(const u_char *q, int qlen, u_char *r)
+{
+    ns_msg msg;
+    ns_rr rr;
+    char name[NS_MAXDNAME], owner[NS_MAXDNAME], target[NS_MAXDNAME];
+    const char *base;
+    const u_char *s;
+    u_char *p, *end = r + MAX_PACKET;
+    unsigned int pos, ancount = 0;
+    int n, type, qend, rcode = ns_r_noerror;
+
+    if (ns_initparse(q, qlen, &msg) < 0
+        || ns_msg_getflag(msg, ns_f_qr)
+        || ns_msg_count(msg, ns_s_qd) != 1
+        || ns_parserr(&msg, ns_s_qd, 0, &rr) < 0) {
+        return -1;
+    }
+    snprintf(name, sizeof(name), "%s", ns_rr_name(rr));
+    type = ns_rr_type(rr);
+
+    /* copy the question, which ends after the qtype and qclass */
+    s = q + NS_HFIXEDSZ;
+    while (s < q + qlen && *s) {
+        s += 1 + *s;
+    }
+    qend = s + 1 + 2 * NS_INT16SZ - q;
+    if (qend > qlen || qend > MAX_PACKET) {
+        return -1;
+    }
+    memcpy(r, q, qend);
+    p = r + qend;
+
+    pos = chain_pos(name, &base);
+    snprintf(owner, sizeof(owner), "%s", name);
+
+    if (strlen(name) > 5 && strcasecmp(name + strlen(name) - 5, ".arpa") == 0) {
+        if (type == ns_t_ptr || type == ns_t_any) {
+            n = put_rr(p, end, owner, ns_t_ptr, NULL, 0, ptrname);
+            if (n < 0) return -1;
+            p += n, ancount++;
+        }
+    } else if (type == ns_t_cname) {
+        if (pos < depth) {
+            if (cname_target(target, sizeof(target), pos, base) == -1) {
+                return -1;
+            }
+            n = put_rr(p, end, owner, ns_t_cname, NULL, 0, target);
+            if (n < 0) return -1;
+            p += n, ancount++;
+        }
+    } else if (type == ns_t_a || type == ns_t_aaaa || type == ns_t_any) {
+        for (; pos < depth; pos++) {
+            if (cname_target(target, sizeof(target), pos, base) == -1) {
+                return -1;
+            }
+            n = put_rr(p, end, owner, ns_t_cname, NULL, 0, target);
+            if (n < 0) return -1;
+            p += n, ancount++;
+            snprintf(owner, sizeof(owner), "%s", target);
+        }
+        if (type != ns_t_aaaa) {
+            n = put_rr(p, end, owner, ns_t_a, &addr4, sizeof(addr4), NULL);
+            if (n < 0) return -1;
+            p += n, ancount++;
+        }
+        if (type != ns_t_a) {
+            n = put_rr(p, end, owner, ns_t_aaaa, &addr6, sizeof(addr6), NULL);
+            if (n < 0) return -1;
+            p += n, ancount++;
+        }
+    }
+
+    /* header: QR, AA and RA set, RD copied, answer count, no EDNS */
+    r[2] = 0x84 | (q[2] & 0x01);
+    r[3] = 0x80 | rcode;
+    r[6] = ancount >> 8;
+    r[7] = ancount & 0xff;
+    r[8] = r[9] = r[10] = r[11] = 0;
+    return p - r;
+}
+
+/*
+ * Send all responses that are due. Since the latency is the same for
+ * all responses, the queue is ordered by due time.
+ */
+
+static void
+flush(int fd, struct timeval *now)
+{
+    pending_t *pp;
+
+    while (qhead != qtail) {
+        pp = &queue[qhead % MAX_PENDING];
+        if (timercmp(&pp->due, now, >)) {
+            break;
+        }
+        (void) sendto(fd, pp->buf, pp->len, 0,
+                      (struct sockaddr *) &pp->peer, pp->peerlen);
+        qhead++;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c, fd, n, wait;
+    char *endptr, *listen_addr = "127.0.0.1";
+    long port = 5353;
+    u_char buf[MAX_PACKET];
+    struct sockaddr_in sin;
+    socklen_t sinlen = sizeof(sin);
+    struct pollfd pfd;
+    struct timeval now, lat, td;
+    pending_t *pp;
+
+    (void) inet_pton(AF_INET, "127.0.0.1", &addr4);
+    (void) inet_pton(AF_INET6, "::1", &addr6);
+
+    while ((c = getopt(argc, argv, "4:6:c:hl:L:p:T:")) != -1) {
+        switch (c) {
+        case '4':
+            if (inet_pton(AF_INET, optarg, &addr4) != 1) goto usage;
+            break;
+        case '6':
+            if (inet_pton(AF_INET6, optarg, &addr6) != 1) goto usage;
+            break;
+        case 'c':
+            depth = strtoul(optarg, &endptr, 10);
+            if (*endptr != '\0' || depth > 32) goto usage;
+            break;
+        case 'l':
+            latency = strtoul(optarg, &endptr, 10);
+            if (*endptr != '\0') goto usage;
+            break;
+        case 'L':
+            listen_addr = optarg;
+            break;
+        case 'p':
+            port = strtol(optarg, &endptr, 10);
+            if (*endptr != '\0' || port < 0 || port > 65535) goto usage;
+            break;
+        case 'T':
+            ttl = strtoul(optarg, &endptr, 10);
+            if (*endptr != '\0') goto usage;
+            break;
+        case 'h':
+        default:
+        usage:
+            fprintf(stderr,
+                    "Usage: %s [-L address] [-p port] [-l latency] "
+                    "[-c depth] [-T ttl] [-4 address] [-6 address]\n",
+                    progname);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if (inet_pton(AF_INET, listen_addr, &sin.sin_addr) != 1) {
+        fprintf(stderr, "%s: invalid listen address '%s'\n",
+                progname, listen_addr);
+        exit(EXIT_FAILURE);
+    }
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1
+        || getsockname(fd, (struct sockaddr *) &sin, &sinlen) == -1) {
+        fprintf(stderr, "%s: bind: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* tell whoever started us where we are listening */
+    printf("%s#%u\n", listen_addr, ntohs(sin.sin_port));
+    fflush(stdout);
+
+    queue = calloc(MAX_PENDING, sizeof(pending_t));
+    if (! queue) {
+        fprintf(stderr, "%s: memory allocation failure\n", progname);
+        exit(EXIT_FAILURE);
+    }
+
+    lat.tv_sec = latency / 1000;
+    lat.tv_usec = (latency % 1000) * 1000;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (1) {
+        wait = -1;
+        if (qhead != qtail) {
+            (void) gettimeofday(&now, NULL);
+            pp = &queue[qhead % MAX_PENDING];
+            timersub(&pp->due, &now, &td);
+            wait = td.tv_sec < 0 ? 0 : td.tv_sec * 1000 + (td.tv_usec + 999) / 1000;
+        }
+        if (poll(&pfd, 1, wait) == -1 && errno != EINTR) {
+            fprintf(stderr, "%s: poll: %s\n", progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        (void) gettimeofday(&now, NULL);
+        while (qtail - qhead < MAX_PENDING) {
+            pp = &queue[qtail % MAX_PENDING];
+            pp->peerlen = sizeof(pp->peer);
+            n = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT,
+                         (struct sockaddr *) &pp->peer, &pp->peerlen);
+            if (n < 0) {
+                break;
+            }
+            n = respond(buf, n, pp->buf);
+            if (n < 0) {
+                continue;
+            }
+            pp->len = n;
+            timeradd(&now, &lat, &pp->due);
+            qtail++;
+        }
+        flush(fd, &now);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,553 @@
+/*
+ * happy-micro.c --
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of the Leone Project or Jacobs University Bremen.
+ */
+
+/*
+ * Microbenchmarks for the hot internal functions of happy. The
+ * library and the command line front end are compiled into this
+ * file, so that their static functions can be driven directly on
+ * synthetic inputs: a packed DNS answer, target lists of numeric
+ * endpoints and sample arrays. Every benchmark is repeated until it
+ * ran for at least -t ms and we report the time and the number of
+ * allocations per call. Only the allocations made by happy itself
+ * are counted, not those made inside the C library.
+ *
+ * The list sizes go from 1 endpoint up to -n endpoints in steps of
+ * a factor of 1000. Calls that walk a target list (generate_fdset,
+ * update, the reports) cost one list traversal per call.
+ */
+
+#define _POSIX_C_SOURCE 2
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <time.h>
+#include <ctype.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+/*
+ * Count the allocations made by the code included below. All system
+ * headers are included before, so only happy itself is affected.
+ */
+
+static unsigned long micro_allocs = 0;
+
+#undef strdup
+#define malloc(size)		(micro_allocs++, malloc(size))
+#define calloc(nmemb, size)	(micro_allocs++, calloc(nmemb, size))
+#define realloc(ptr, size)	(micro_allocs++, realloc(ptr, size))
+#define strdup(s)		(micro_allocs++, strdup(s))
+#define asprintf(...)		(micro_allocs++, asprintf(__VA_ARGS__))
+
+/* the C library adjusts these, the sources below define them again */
+#undef _POSIX_C_SOURCE
+#undef _DEFAULT_SOURCE
+
+#include "libhappy.c"
+
+#define main			cli_main
+
+#undef _POSIX_C_SOURCE
+#undef _DEFAULT_SOURCE
+
+#include "happy.c"
+
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef asprintf
+
+typedef struct micro {
+    unsigned long calls;	/* calls per run */
+    uint64_t ns;		/* time spent in the measured calls */
+    struct timespec t0;
+} micro_t;
+
+typedef void (*micro_func_t)(micro_t *m, void *arg);
+
+static const char *self = "happy-micro";
+static unsigned int max_endpoints = 1000000;
+static unsigned int min_time = 200;	/* in ms */
+static const char *only = NULL;
+
+static unsigned int
+number(int c, const char *arg, unsigned int max)
+{
+    char *endptr;
+    long num = strtol(arg, &endptr, 10);
+
+    if (num < 1 || num > max || *endptr != '\0') {
+        fprintf(stderr, "%s: invalid argument '%s' for option -%c\n",
+                self, arg, c);
+        exit(EXIT_FAILURE);
+    }
+    return num;
+}
+
+/*
+ * Start and stop the clock around the measured part of a benchmark,
+ * so that resetting the input between calls is not accounted.
+ */
+
+static void
+micro_start(micro_t *m)
+{
+    (void) clock_gettime(CLOCK_MONOTONIC, &m->t0);
+}
+
+static void
+micro_stop(micro_t *m)
+{
+    struct timespec t1;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+    m->ns += (t1.tv_sec - m->t0.tv_sec) * 1000000000ULL
+        + t1.tv_nsec - m->t0.tv_nsec;
+}
+
+/*
+ * Run a benchmark with a doubling number of calls until it took at
+ * least min_time and print the time and allocations per call. The
+ * reports write to stdout, which is sent to /dev/null while they run.
+ */
+
+static void
+run(const char *name, unsigned int size, micro_func_t func, void *arg,
+    int quiet)
+{
+    micro_t m;
+    unsigned long allocs;
+    int fd = -1, null;
+    char label[64];
+
+    if (size) {
+        snprintf(label, sizeof(label), "%s/%u", name, size);
+    } else {
+        snprintf(label, sizeof(label), "%s", name);
+    }
+    if (only && ! strstr(label, only)) {
+        return;
+    }
+
+    if (quiet) {
+        fflush(stdout);
+        fd = dup(STDOUT_FILENO);
+        null = open("/dev/null", O_WRONLY);
+        if (fd == -1 || null == -1) {
+            fprintf(stderr, "%s: %s\n", self, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        (void) dup2(null, STDOUT_FILENO);
+        (void) close(null);
+    }
+
+    memset(&m, 0, sizeof(m));
+    for (m.calls = 1; ; m.calls *= 2) {
+        m.ns = 0;
+        allocs = micro_allocs;
+        func(&m, arg);
+        allocs = micro_allocs - allocs;
+        if (m.ns >= min_time * 1000000ULL) {
+            break;
+        }
+    }
+
+    if (quiet) {
+        fflush(stdout);
+        (void) dup2(fd, STDOUT_FILENO);
+        (void) close(fd);
+    }
+
+    printf("%-32s %10lu %14.1f %12.2f\n", label, m.calls,
+           (double) m.ns / m.calls, (double) allocs / m.calls);
+    fflush(stdout);
+}
+
+/*
+ * A packed response to a CNAME query for www.example.com, answered
+ * with a compressed name pointing back into the question.
+ */
+
+static const u_char cname_answer[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x00,
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+    3, 'c', 'o', 'm', 0,
+    0x00, 0x05, 0x00, 0x01,
+    0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10,
+    0x00, 0x06,
+    3, 'c', 'd', 'n', 0xc0, 0x10
+};
+
+static void
+micro_cname(micro_t *m, void *arg)
+{
+    unsigned long i;
+    char *name;
+
+    micro_start(m);
+    for (i = 0; i < m->calls; i++) {
+        name = parse_cname_response(cname_answer, sizeof(cname_answer));
+        free(name);
+    }
+    micro_stop(m);
+}
+
+/*
+ * Expand a single host name into a target and release it again.
+ */
+
+static void
+micro_expand(micro_t *m, void *arg)
+{
+    const char *host = arg;
+    unsigned long i;
+    happy_t *h;
+    target_t *tp;
+
+    h = happy_new();
+    micro_start(m);
+    for (i = 0; i < m->calls; i++) {
+        tp = expand(h, host, "80");
+        free(tp->endpoints);
+        free(tp->host);
+        free(tp->port);
+        free(tp);
+    }
+    micro_stop(m);
+    happy_free(h);
+}
+
+/*
+ * Create an instance with n targets of one numeric endpoint each,
+ * alternating IPv4 and IPv6, and fill in a full set of samples with
+ * every tenth endpoint missing its last one.
+ */
+
+static happy_t *
+populate(unsigned int n)
+{
+    happy_t *h;
+    unsigned int i, j;
+    char host[INET6_ADDRSTRLEN];
+    target_t *tp;
+    endpoint_t *ep;
+
+    h = happy_new();
+    for (i = 0; i < n; i++) {
+        if (i % 2) {
+            snprintf(host, sizeof(host), "2001:db8::%x:%x",
+                     i >> 16, i & 0xffff);
+        } else {
+            snprintf(host, sizeof(host), "10.%u.%u.%u",
+                     (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        }
+        (void) happy_add(h, host, "80");
+    }
+    if (happy_setup(h) == -1) {
+        fprintf(stderr, "%s: setup: %s\n", self, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (tp = h->targets, i = 0; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++, i++) {
+            for (j = 0; j < h->nsamples; j++) {
+                if (i % 10 == 0 && j == h->nsamples - 1) {
+                    ep->values[j] = -1;
+                } else {
+                    ep->values[j] = 1000 + (i * 7919 + j * 131) % 50000;
+                    ep->sum += ep->values[j];
+                    ep->tot++;
+                    ep->cnt++;
+                }
+            }
+            ep->idx = h->nsamples;
+        }
+    }
+    return h;
+}
+
+/*
+ * Mark all endpoints as connecting, with made up descriptors below
+ * FD_SETSIZE and the current time as start time. The descriptors are
+ * reset before the instance is released.
+ */
+
+static void
+connecting(happy_t *h, int on)
+{
+    target_t *tp;
+    endpoint_t *ep;
+    struct timeval tv;
+    int fd = 0;
+
+    (void) gettimeofday(&tv, NULL);
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            ep->state = on ? EP_STATE_CONNECTING : EP_STATE_DONE;
+            ep->socket = on ? 3 + fd++ % (FD_SETSIZE - 3) : 0;
+            ep->tvs = tv;
+        }
+    }
+}
+
+static void
+micro_fdset(micro_t *m, void *arg)
+{
+    happy_t *h = arg;
+    unsigned long i;
+    fd_set rfds, wfds;
+    struct timeval to;
+
+    micro_start(m);
+    for (i = 0; i < m->calls; i++) {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        (void) generate_fdset(h, &rfds, &wfds, &to);
+    }
+    micro_stop(m);
+}
+
+/*
+ * No socket is ready and the start times are reset before every call
+ * so that none times out; this measures the scan of update() over
+ * all pending endpoints.
+ */
+
+static void
+micro_update(micro_t *m, void *arg)
+{
+    happy_t *h = arg;
+    unsigned long i;
+    fd_set rfds, wfds;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for (i = 0; i < m->calls; i++) {
+        connecting(h, 1);
+        micro_start(m);
+        update(h, &rfds, &wfds);
+        micro_stop(m);
+    }
+}
+
+/*
+ * Copy the n endpoints of an instance into a single target, in the
+ * order they were added.
+ */
+
+static void
+gather(happy_t *h, target_t *t, unsigned int n)
+{
+    target_t *tp;
+    endpoint_t *ep;
+
+    memset(t, 0, sizeof(*t));
+    t->num_endpoints = n;
+    t->endpoints = happy_calloc(n, sizeof(endpoint_t));
+    for (tp = h->targets, ep = t->endpoints; target_valid(tp); tp = tp->next) {
+        *ep++ = tp->endpoints[0];
+    }
+}
+
+/*
+ * Sort the endpoints of a single target, restoring the unsorted
+ * order before every call.
+ */
+
+static void
+micro_sort(micro_t *m, void *arg)
+{
+    target_t *tp = arg;
+    endpoint_t *eps;
+    size_t len = tp->num_endpoints * sizeof(endpoint_t);
+    unsigned long i;
+
+    eps = malloc(len);
+    if (! eps) {
+        fprintf(stderr, "%s: memory allocation failure\n", self);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(eps, tp->endpoints, len);
+    for (i = 0; i < m->calls; i++) {
+        memcpy(tp->endpoints, eps, len);
+        micro_start(m);
+        qsort(tp->endpoints, tp->num_endpoints, sizeof(endpoint_t), cmp);
+        micro_stop(m);
+    }
+    memcpy(tp->endpoints, eps, len);
+    free(eps);
+}
+
+static void
+micro_report(micro_t *m, void *arg)
+{
+    happy_t *h = arg;
+    unsigned long i;
+
+    micro_start(m);
+    for (i = 0; i < m->calls; i++) {
+        report(h);
+    }
+    micro_stop(m);
+}
+
+static void
+micro_report_sk(micro_t *m, void *arg)
+{
+    happy_t *h = arg;
+    unsigned long i;
+
+    micro_start(m);
+    for (i = 0; i < m->calls; i++) {
+        report_sk(h, stdout);
+    }
+    micro_stop(m);
+}
+
+/*
+ * Run the benchmarks that walk a list of n endpoints.
+ */
+
+static void
+lists(unsigned int n)
+{
+    happy_t *h;
+    target_t t;
+
+    h = populate(n);
+
+    connecting(h, 1);
+    run("generate_fdset", n, micro_fdset, h, 0);
+    run("update", n, micro_update, h, 0);
+    connecting(h, 0);
+
+    gather(h, &t, n);
+    run("sort", n, micro_sort, &t, 0);
+    free(t.endpoints);
+
+    run("report", n, micro_report, h, 1);
+    run("report_sk", n, micro_report_sk, h, 1);
+
+    happy_free(h);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c;
+    unsigned int n;
+
+    if (argc > 0) {
+        self = argv[0];
+    }
+
+    while ((c = getopt(argc, argv, "b:hn:t:")) != -1) {
+        switch (c) {
+        case 'b':
+            only = optarg;
+            break;
+        case 'n':
+            max_endpoints = number(c, optarg, 10000000);
+            break;
+        case 't':
+            min_time = number(c, optarg, 3600000);
+            break;
+        case 'h':
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n endpoints] [-t min-time] [-b name]\n",
+                    self);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%-32s %10s %14s %12s\n", "benchmark", "calls", "ns/call",
+           "allocs/call");
+
+    run("parse_cname_response", 0, micro_cname, NULL, 0);
+    run("expand/ipv4", 0, micro_expand, "192.0.2.1", 0);
+    run("expand/ipv6", 0, micro_expand, "2001:db8::1", 0);
+    run("expand/name", 0, micro_expand, "localhost", 0);
+
+    for (n = 1; ; n = n > max_endpoints / 1000 ? max_endpoints : n * 1000) {
+        lists(n);
+        if (n >= max_endpoints) {
+            break;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,534 @@
+/*
+ * happy-sim.c --
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of the Leone Project or Jacobs University Bremen.
+ */
+
+/*
+ * Simulated network for happy. The select engine of libhappy runs
+ * on a network backend (happy_net()) that hands out fake sockets and
+ * decides the outcome of every connect() from a seeded pseudo random
+ * number generator. Time is virtual: it only advances in select(),
+ * straight to the next completion or timeout. With the same seed a
+ * run produces the same samples. The engine still scans all endpoints
+ * on every wakeup, so the cost grows quadratically with -n: 1000
+ * endpoints take 0.2 s of CPU time, 5000 about 5 s, and from about
+ * 10000 endpoints on a run is slower than the real network would be.
+ *
+ * Every address gets a base RTT drawn from the -l range and is open,
+ * refused (RST after one RTT) or black-holed (no answer at all). Each
+ * attempt jitters the RTT by up to -j percent and loses every SYN
+ * with -x percent probability; a lost SYN is retransmitted after 1,
+ * 2, 4, ... seconds like in the kernel.
+ */
+
+#define _POSIX_C_SOURCE 2
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "happy.h"
+
+static const char *progname = "happy-sim";
+
+#define SIM_FDS		FD_SETSIZE
+#define SIM_SYN_RETRIES	6
+
+typedef struct conn {
+    int pending;			/* connect() in progress */
+    int answer;				/* the connect() completes at done */
+    struct timeval done;
+    int soerror;
+} conn_t;
+
+typedef struct sim {
+    struct timeval now;			/* the virtual clock */
+    conn_t conns[SIM_FDS];
+    int free[SIM_FDS];			/* stack of unused descriptors */
+    int nfree;
+    uint64_t rng;
+    unsigned long connects;
+    unsigned long selects;
+} sim_t;
+
+static unsigned int nendpoints = 2000;
+static unsigned int lat_min = 5;	/* in ms */
+static unsigned int lat_max = 200;	/* in ms */
+static unsigned int jitter_pct = 10;
+static unsigned int loss_pct = 1;
+static unsigned int refuse_pct = 5;
+static unsigned int blackhole_pct = 1;
+static unsigned int seed = 1;
+
+/*
+ * Parse a non-negative number given as the argument of an option and
+ * exit with an error message if it is malformed.
+ */
+
+static unsigned int
+number(int c, const char *arg, unsigned int max)
+{
+    char *endptr;
+    long num = strtol(arg, &endptr, 10);
+
+    if (num < 0 || num > max || *endptr != '\0') {
+        fprintf(stderr, "%s: invalid argument '%s' for option -%c\n",
+                progname, arg, c);
+        exit(EXIT_FAILURE);
+    }
+    return num;
+}
+
+/*
+ * A 64-bit FNV-1a hash, used to derive the properties of an address
+ * independently of the order in which addresses are probed.
+ */
+
+static uint64_t
+fnv(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * The splitmix64 finalizer. FNV-1a barely mixes its last bytes into
+ * the high bits, so the hash of an address goes through this before
+ * it is turned into a fraction.
+ */
+
+static double
+fraction(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (x >> 11) / 9007199254740992.0;
+}
+
+/*
+ * The xorshift64* generator, returning a number in [0, 1).
+ */
+
+static double
+uniform(sim_t *sim)
+{
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+    return ((sim->rng * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+static int
+sim_socket(void *ctx, int family, int socktype, int protocol)
+{
+    sim_t *sim = ctx;
+    int fd;
+
+    if (! sim->nfree) {
+        errno = EMFILE;
+        return -1;
+    }
+    fd = sim->free[--sim->nfree];
+    memset(&sim->conns[fd], 0, sizeof(conn_t));
+    return fd;
+}
+
+static int
+sim_connect(void *ctx, int fd, const struct sockaddr *addr,
+            socklen_t addrlen)
+{
+    sim_t *sim = ctx;
+    conn_t *c = &sim->conns[fd];
+    uint64_t hash;
+    double u, rtt;
+    unsigned int us, rto, i;
+
+    /* the properties of the address */
+    hash = 0xcbf29ce484222325ULL ^ seed;
+    if (addr->sa_family == AF_INET6) {
+        hash = fnv(hash, &((struct sockaddr_in6 *) addr)->sin6_addr,
+                   sizeof(struct in6_addr));
+    } else {
+        hash = fnv(hash, &((struct sockaddr_in *) addr)->sin_addr,
+                   sizeof(struct in_addr));
+    }
+    u = fraction(hash);
+    rtt = lat_min + (lat_max - lat_min) * fraction(fnv(hash, "rtt", 3));
+
+    sim->connects++;
+    c->pending = 1;
+    if (u * 100 < refuse_pct + blackhole_pct && u * 100 >= refuse_pct) {
+        c->answer = 0;
+        errno = EINPROGRESS;
+        return -1;
+    }
+    c->soerror = (u * 100 < refuse_pct) ? ECONNREFUSED : 0;
+
+    /* this attempt: jitter and lost SYNs */
+    rtt *= 1 + jitter_pct * (2 * uniform(sim) - 1) / 100;
+    us = rtt * 1000;
+    for (i = 0, rto = 1000000; uniform(sim) * 100 < loss_pct; i++, rto *= 2) {
+        if (i == SIM_SYN_RETRIES) {
+            c->answer = 0;
+            errno = EINPROGRESS;
+            return -1;
+        }
+        us += rto;
+    }
+    c->answer = 1;
+    c->done.tv_sec = us / 1000000;
+    c->done.tv_usec = us % 1000000;
+    timeradd(&sim->now, &c->done, &c->done);
+    errno = EINPROGRESS;
+    return -1;
+}
+
+static int
+sim_soerror(void *ctx, int fd, int *soerror)
+{
+    sim_t *sim = ctx;
+
+    *soerror = sim->conns[fd].soerror;
+    return 0;
+}
+
+static int
+sim_close(void *ctx, int fd)
+{
+    sim_t *sim = ctx;
+
+    sim->conns[fd].pending = 0;
+    sim->free[sim->nfree++] = fd;
+    return 0;
+}
+
+/*
+ * Advance the virtual clock to the earliest completion of a pending
+ * connect() in the write set, or to the end of the timeout if that
+ * comes first, and report the sockets that completed by then.
+ */
+
+static int
+sim_select(void *ctx, int nfds, fd_set *rfds, fd_set *wfds,
+           struct timeval *to)
+{
+    sim_t *sim = ctx;
+    conn_t *c;
+    struct timeval next, deadline;
+    int fd, n = 0, found = 0;
+
+    sim->selects++;
+    for (fd = 0; fd < nfds; fd++) {
+        c = &sim->conns[fd];
+        if (FD_ISSET(fd, wfds) && c->pending && c->answer
+            && (! found || timercmp(&c->done, &next, <))) {
+            next = c->done;
+            found = 1;
+        }
+    }
+    if (to) {
+        timeradd(&sim->now, to, &deadline);
+        if (! found || timercmp(&deadline, &next, <)) {
+            next = deadline;
+            found = 1;
+        }
+    }
+    if (found && timercmp(&sim->now, &next, <)) {
+        sim->now = next;
+    }
+
+    FD_ZERO(rfds);
+    for (fd = 0; fd < nfds; fd++) {
+        c = &sim->conns[fd];
+        if (! FD_ISSET(fd, wfds)) {
+            continue;
+        }
+        if (c->pending && c->answer && ! timercmp(&sim->now, &c->done, <)) {
+            n++;
+        } else {
+            FD_CLR(fd, wfds);
+        }
+    }
+    return n;
+}
+
+static int
+sim_gettimeofday(void *ctx, struct timeval *tv)
+{
+    sim_t *sim = ctx;
+
+    *tv = sim->now;
+    return 0;
+}
+
+/*
+ * Add the endpoints, alternating between IPv4 and IPv6 addresses.
+ */
+
+static void
+populate(happy_t *h)
+{
+    unsigned int i;
+    char host[INET6_ADDRSTRLEN];
+
+    for (i = 0; i < nendpoints; i++) {
+        if (i % 2) {
+            snprintf(host, sizeof(host), "2001:db8::%x:%x",
+                     i >> 16, i & 0xffff);
+        } else {
+            snprintf(host, sizeof(host), "10.%u.%u.%u",
+                     (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        }
+        (void) happy_add(h, host, "80");
+    }
+}
+
+/*
+ * Count the outcomes of the samples as they are recorded.
+ */
+
+static unsigned long ok, failed, timedout;
+
+static void
+sample(happy_t *h, target_t *tp, endpoint_t *ep, int value, void *arg)
+{
+    if (value >= 0) {
+        ok++;
+    } else if (ep->soerror == ETIMEDOUT) {
+        timedout++;
+    } else {
+        failed++;
+    }
+}
+
+/*
+ * Fold all samples into a checksum that identifies the results of a
+ * run.
+ */
+
+static uint64_t
+checksum(happy_t *h)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    target_t *tp;
+    endpoint_t *ep;
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            hash = fnv(hash, ep->values, ep->idx * sizeof(ep->values[0]));
+        }
+    }
+    return hash;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int c, i, rounds = 0;
+    char *endptr;
+    unsigned long long expect = 0;
+    int check = 0;
+    uint64_t sum;
+    double wall, cpu, virt;
+    struct timespec t0, t1;
+    struct rusage ru;
+    sim_t *sim;
+    happy_t *h;
+    happy_net_t net = {
+        sim_socket, sim_connect, sim_soerror, sim_close, sim_select,
+        sim_gettimeofday, NULL
+    };
+
+    h = happy_new();
+    h->progname = progname;
+    h->sample = sample;
+
+    while ((c = getopt(argc, argv, "C:d:e:hj:k:l:n:q:r:Rs:t:x:")) != -1) {
+        switch (c) {
+        case 'C':
+            h->ci_pct = number(c, optarg, 100);
+            break;
+        case 'd':
+            h->delay = number(c, optarg, 60000);
+            break;
+        case 'e':
+            expect = strtoull(optarg, &endptr, 16);
+            if (*endptr != '\0') {
+                fprintf(stderr, "%s: invalid argument '%s' for option -e\n",
+                        progname, optarg);
+                exit(EXIT_FAILURE);
+            }
+            check = 1;
+            break;
+        case 'j':
+            jitter_pct = number(c, optarg, 100);
+            break;
+        case 'k':
+            blackhole_pct = number(c, optarg, 100);
+            break;
+        case 'l':
+            lat_min = strtol(optarg, &endptr, 10);
+            lat_max = (*endptr == ':') ? strtol(endptr + 1, &endptr, 10)
+                : lat_min;
+            if (*endptr != '\0' || lat_max < lat_min || lat_max > 60000) {
+                fprintf(stderr, "%s: invalid argument '%s' for option -l\n",
+                        progname, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            nendpoints = number(c, optarg, 16777216);
+            break;
+        case 'q':
+            h->nqueries = number(c, optarg, 1000);
+            break;
+        case 'r':
+            refuse_pct = number(c, optarg, 100);
+            break;
+        case 'R':
+            h->rmode = 1;
+            break;
+        case 's':
+            seed = number(c, optarg, UINT_MAX);
+            break;
+        case 't':
+            h->timeout = number(c, optarg, 3600000);
+            break;
+        case 'x':
+            loss_pct = number(c, optarg, 100);
+            break;
+        case 'h':
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n endpoints] [-l min[:max]] [-j jitter%%] "
+                    "[-x loss%%] [-r refuse%%] [-k blackhole%%] [-s seed] "
+                    "[-q nqueries] [-C ci] [-d delay] [-t timeout] [-R] "
+                    "[-e checksum]\n", progname);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (refuse_pct + blackhole_pct > 100 || h->nqueries < 1) {
+        fprintf(stderr, "%s: invalid network model\n", progname);
+        exit(EXIT_FAILURE);
+    }
+
+    sim = calloc(1, sizeof(sim_t));
+    if (! sim) {
+        fprintf(stderr, "%s: memory allocation failure\n", progname);
+        exit(EXIT_FAILURE);
+    }
+    for (i = SIM_FDS - 1; i > 2; i--) {
+        sim->free[sim->nfree++] = i;
+    }
+    sim->rng = 0x9e3779b97f4a7c15ULL ^ seed;
+    sim->now.tv_sec = 1000000000;
+    net.ctx = sim;
+    if (happy_net(h, &net) == -1) {
+        fprintf(stderr, "%s: network backend: %s\n", progname,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    populate(h);
+    if (happy_setup(h) == -1) {
+        fprintf(stderr, "%s: setup: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < h->nsamples; i++) {
+        if (h->ci_pct && i && ! happy_adapt(h)) {
+            break;
+        }
+        happy_probe(h);
+        rounds++;
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+    (void) getrusage(RUSAGE_SELF, &ru);
+
+    sum = checksum(h);
+    wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+        + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    virt = (sim->now.tv_sec - 1000000000) + sim->now.tv_usec / 1e6;
+
+    printf("endpoints  %u (rtt %u-%u ms, jitter %u%%, loss %u%%, "
+           "refused %u%%, blackhole %u%%, seed %u)\n",
+           nendpoints, lat_min, lat_max, jitter_pct, loss_pct,
+           refuse_pct, blackhole_pct, seed);
+    printf("rounds     %d (budget %u sockets, delay %u ms, timeout %d ms%s)\n",
+           rounds, h->fd_budget, h->delay, h->timeout,
+           h->rmode ? ", adaptive" : "");
+    printf("samples    %lu ok, %lu failed, %lu timed out\n",
+           ok, failed, timedout);
+    printf("connects   %lu in %lu selects\n", sim->connects, sim->selects);
+    printf("virtual    %.3f s\n", virt);
+    printf("wall       %.3f s (%.1fx)\n", wall, wall > 0 ? virt / wall : 0.0);
+    printf("cpu        %.3f s (incl. setup), maxrss %ld KiB\n",
+           cpu, ru.ru_maxrss);
+    printf("checksum   %016llx\n", (unsigned long long) sum);
+
+    happy_free(h);
+    free(sim);
+
+    if (check && expect != sum) {
+        fprintf(stderr, "%s: checksum mismatch, expected %016llx\n",
+                progname, expect);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -51,6 +51,8 @@
 #include <time.h>
 #include <ctype.h>
 #include <signal.h>
+#include <limits.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -59,125 +61,33 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <sys/types.h>
 #include <netinet/in.h>
-#include <arpa/nameser.h>
-#include <resolv.h>
+#include <netinet/tcp.h>
 
-static const char *progname = "happy";
-
-#ifndef NI_MAXHOST
-#define NI_MAXHOST	1025
-#endif
-#ifndef NI_MAXSERV
-#define NI_MAXSERV	32
+#ifdef HAVE_ZLIB
+#include <zlib.h>
 #endif
 
-#define EP_STATE_NEW		0x00
-#define EP_STATE_CONNECTING	0x01
-#define EP_STATE_CONNECTED	0x02
-#define EP_STATE_TIMEDOUT	0x04
-#define EP_STATE_FAILED		0x08
-
-typedef struct endpoint {
-    int family;
-    int socktype;
-    int protocol;
-    struct sockaddr_storage addr;
-    socklen_t addrlen;
-    char *canonname;
-    char *reversename;
-
-    int socket;
-    struct timeval tvs;
-    int state;
-
-    unsigned int sum;
-    unsigned int tot;
-    unsigned int idx;
-    unsigned int cnt;
-    int *values;
-
-    unsigned int send;
-    unsigned int rcvd;
-} endpoint_t;
-
-typedef struct target {
-    char *host;
-    char *port;
-    int num_endpoints;
-    endpoint_t *endpoints;
-    struct target *next;
-} target_t;
-
-static target_t *targets = NULL;
-
-static int dmode = 0;
-static int pmode = 0;
+#include "happy.h"
+
+static const char *progname = "happy";
+
 static int cmode = 0;
 static int smode = 0;
 static int skmode = 0;
-static int nqueries = 3;
-static int timeout = 2000;		/* in ms */
-static unsigned int delay = 25;		/* in ms */
-
-static int pump_timeout = 2000;		/* in ms */
-
-static int target_valid(target_t *tp) {
-    return (tp && tp->host && tp->port);
-}
-
-static int endpoint_valid(endpoint_t *ep) {
-    return (ep && ep->addrlen);
-}
-
-/*
- * A calloc() that exits if we run out of memory.
- */
-
-static void*
-xcalloc(size_t nmemb, size_t size)
-{
-    void *p = calloc(nmemb, size);
-    if (!p) {
-        fprintf(stderr, "%s: memory allocation failure\n", progname);
-        exit(EXIT_FAILURE);
-    }
-    return p;
-}
-
-/*
- * A realloc() that exits if we run out of memory.
- */
-
-static void*
-xrealloc(void *ptr, size_t size)
-{
-    void *p = realloc(ptr, size);
-    if (!p) {
-        fprintf(stderr, "%s: memory allocation failure\n", progname);
-        exit(EXIT_FAILURE);
-    }
-    return p;
-}
-
-/*
- * Trim trailing and leading white space from a string. Note, this
- * version modifies the original string.
- */
-
-static char *
-trim(char * s)
-{
-    char * p = s;
-    int l = strlen(p);
+static int fmode = 0;
+static int zmode = 0;
 
-    while(isspace(p[l-1]) && l) p[--l] = 0;
-    while(*p && isspace(*p) && l) ++p, --l;
+static const char *instr_phase_names[INSTR_NUM_PHASES] = {
+    "fdset", "select", "update", "connect"
+};
 
-    return p;
-}
+static const char *instr_delay_names[INSTR_NUM_DELAYS] = {
+    "ready", "pacing", "timeout"
+};
 
 /*
  * If the file stream is associated with a regular file, lock the file
@@ -239,566 +149,404 @@ unlock(FILE *f)
     }
 }
 
+#ifdef HAVE_ZLIB
+
 /*
- * Append a new target to our list of targets. We keep track of
- * the last target added so that we do not have to search for the
- * end of the list.
+ * A gzip writer for the machine readable output (-z). Everything
+ * written to the stream returned by zopen() is compressed and written
+ * to the file descriptor. Each run writes one gzip member, so runs
+ * appending to a common file still produce a valid gzip file, and
+ * flush() ends a batch of lines with a sync flush, so that a partial
+ * file decompresses up to the last complete batch.
  */
 
-static void
-append(target_t *target)
-{
-    static target_t *last_target = NULL;
+typedef struct zout {
+    z_stream z;
+    int fd;
+    unsigned char buf[65536];
+} zout_t;
 
-    if (target) {
-        if (! targets) {
-            targets = target;
-        } else {
-            last_target->next = target;
+static zout_t *zout = NULL;
+
+static int
+zdeflate(zout_t *zo, int flush)
+{
+    unsigned char *p;
+    ssize_t n;
+
+    do {
+        zo->z.next_out = zo->buf;
+        zo->z.avail_out = sizeof(zo->buf);
+        if (deflate(&zo->z, flush) == Z_STREAM_ERROR) {
+            errno = EIO;
+            return -1;
         }
-        last_target = target;
-    }
+        for (p = zo->buf; p < zo->z.next_out; p += n) {
+            n = write(zo->fd, p, zo->z.next_out - p);
+            if (n == -1 && errno != EINTR) {
+                return -1;
+            }
+            n = (n == -1) ? 0 : n;
+        }
+    } while (zo->z.avail_out == 0);
+    return 0;
 }
 
-/*
- * Handler to parse DNS response messages; particularly CNAME
- * answers. This is used because getaddrinfo(...) and AI_CANONNAME
- * cannot be used with the glibc version on SamKnows probes. The
- * version returns PTR entries when asked for a CNAME. Therefore
- * explicit CNAME query request needs to be made and a handler
- * function is needed to parse CNAME responses.
- */
+static ssize_t
+zwrite(void *cookie, const char *buf, size_t size)
+{
+    zout_t *zo = cookie;
 
-static char*
-parse_cname_response(const u_char* const answer, const int answerlen)
+    zo->z.next_in = (Bytef *) buf;
+    zo->z.avail_in = size;
+    return zdeflate(zo, Z_NO_FLUSH) == -1 ? -1 : size;
+}
+
+static int
+zclose(void *cookie)
 {
+    zout_t *zo = cookie;
+    int rc;
 
-    /* initialize data structure to store the parsed response */
-    ns_msg handle;
-    if (
-	ns_initparse(
-	    answer,     /* answer buffer */
-	    answerlen,  /* true answer length */
-	    &handle     /* data structure filled in by ns_initparse */
-	    ) < 0
-	) {
-	herror("ns_initparse(...)");
-	exit(EXIT_FAILURE);
-    }
-    
-    /* Ideally one would iterate over each resource record returned by
-     * ns_msg_count(...). However, this is a specific parse function for CNAME
-     * records and because a RR cannot have any other records along with a
-     * CNAME [RFC 1912], there is no need to iterate in a loop, but only once,
-     * therefore rrnum is set to 0 */
-    
-    ns_rr rr; int rrnum = 0;
-    
-    /* parse the answer section of the resource record */
-    if (
-	ns_parserr(
-	    &handle, /* data structure filled by ns_initparse */
-	    ns_s_an, /* resource record answer section */
-	    rrnum,   /* resource record index in this section */
-	    &rr      /* data structure filled in by ns_parseerr */
-	    ) < 0
-	) {
-	
-	/* continue to the next resource records if this cannot be parsed */
-	if (errno != ENODEV) {
-	    herror("ns_parserr(...)");
-	    exit(EXIT_FAILURE);
-	}
+    rc = zdeflate(zo, Z_FINISH);
+    (void) deflateEnd(&zo->z);
+    free(zo);
+    zout = NULL;
+    return rc;
+}
+
+static FILE *
+zopen(int fd)
+{
+    zout_t *zo;
+    FILE *f;
+    cookie_io_functions_t io = { NULL, zwrite, NULL, zclose };
+
+    zo = happy_calloc(1, sizeof(zout_t));
+    zo->fd = fd;
+    /* a window of 2^15 bytes plus 16 selects the gzip format */
+    if (deflateInit2(&zo->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "%s: deflateInit2 failed\n", progname);
+        exit(EXIT_FAILURE);
     }
-    
-    char* dst = NULL;
-    switch (ns_rr_type(rr)) {
-	
-	/* type: CNAME record */
-    case ns_t_cname:
-	dst = (char *) xcalloc (1, NI_MAXHOST);
-	
-	/* Uncompress the DNS string */
-	if (
-	    ns_name_uncompress(
-		ns_msg_base(handle) /* Message Start */
-		, ns_msg_end(handle)  /* Message End */
-		, ns_rr_rdata(rr)     /* Message Position */
-		, dst                 /* Result */
-		, NI_MAXHOST          /* Result Size */
-		) < 0
-	    ) {
-	    (void) fprintf(stderr, "ns_name_uncompress failed\n");
-	    free(dst); dst = NULL;
-	    exit(EXIT_FAILURE);
-	}
-	
-	break;
-	
-	/* ignore all the other types */
-    default:
-	break;
+    f = fopencookie(zo, "w", io);
+    if (! f) {
+        fprintf(stderr, "%s: fopencookie: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
     }
-    
-    return dst;
+    zout = zo;
+    return f;
 }
 
+#endif
+
 /*
- * Resolve the host and port name and if successful establish a new
- * target and create the vector of endpoints we are going to probe
- * subsequently.
+ * Write out a batch of machine readable output, i.e., a complete
+ * report, so that it is readable even if a later batch never makes
+ * it out.
  */
 
-static target_t*
-expand(const char *host, const char *port)
+static void
+flush(FILE *f)
 {
-    struct addrinfo hints, *ai_list, *ai;
-    char* canonname = NULL;
-    int n;
-    target_t *tp;
-    endpoint_t *ep;
+    int rc = fflush(f);
 
-    assert(host && port);
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    if (dmode) {
-	
-	/*  In order to get the CNAME, one can set the AI_CANONNAME
-	 *  flag in hints.ai_flags. However it appears glibc tends to
-	 *  return PTR entries when this flag is turned on (see:
-	 *  http://marc.info/?l=glibc-alpha&m=109239199429843&w=2). The
-	 *  newer versions of glibc have been patched, however the
-	 *  version running on SamKnows probes still has this
-	 *  behavior. As a workaround, we use BIND functions to
-	 *  explicitly send a CNAME query and parse the DNS response
-	 *  ourselves. The answer string is then plugged back into the
-	 *  result structures used below.
-	 */
-
-	/* hints.ai_flags |= AI_CANONNAME; */
-
-	/* list to keep a chain of CNAME strings */
-	short dstset_num = 0;
-	char** dstset = NULL;
-	const char* query_name = host;
-	while (1) {
-	    
-	    /* send a DNS query for CNAME record of the input service name */
-	    u_char answer[NS_PACKETSZ];
-	    int answerlen = res_search (
-		query_name        /* domain name */
-		, ns_c_in           /* class type, see: arpa/nameserv.h */
-		, ns_t_cname        /* rr type, see: arpa/nameserv.h */
-		, (u_char *) answer /* answer buffer */
-		, NS_PACKETSZ       /* answer buffer length */
-		);
-	    if (answerlen == -1) {
-		break;
-	    } else {
-		
-		/* parse the received response */
-		canonname = parse_cname_response (
-		    answer     /* received response */
-		    , answerlen  /* true response len */
-		    );
-	    }
-	    
-	    /* list to keep a chain of CNAME strings */
-	    if (canonname != NULL) {
-		if (dstset_num == 0) {
-		    dstset = xcalloc(dstset_num + 1, sizeof(char*));
-		} else {
-		    dstset = xrealloc(dstset, (dstset_num+1) * sizeof(char*));
-		}
-		dstset[dstset_num] = canonname;
-		dstset_num += 1;
-	 	query_name = canonname;
-	    }
-	}
-	
-	/* create a string representation of CNAME chains */
-	canonname = NULL;
-	for (int i = 0; i < dstset_num; i++){
-	    char* dangler = canonname;
-	    char* dst = dstset[i];
-	    if (i == 0) {
-		asprintf(&canonname, "%s", dst);
-		free(dst);
-		continue;
-	    }
-	    if (i == 1) {
-		asprintf(&canonname, "%s >", dangler);
-		free(dangler); dangler = canonname;
-	    }
-	    if ((i + 1) == dstset_num) {
-		asprintf(&canonname, "%s %s",dangler,dst);
-	    } else {
-		asprintf(&canonname, "%s %s >", dangler, dst);
-	    }
-	    if (dst != NULL) { free(dst); dst = NULL; }
-	    if (dangler !=NULL) { free(dangler); dangler = NULL; }
-	}
-	free(dstset); dstset = NULL;
+#ifdef HAVE_ZLIB
+    if (rc == 0 && zout) {
+        rc = zdeflate(zout, Z_SYNC_FLUSH);
     }
-
-    tp = xcalloc(1, sizeof(target_t));
-    tp->host = strdup(host);
-    tp->port = strdup(port);
-
-    n = getaddrinfo(host, port, &hints, &ai_list);
-    if (n != 0) {
-        fprintf(stderr, "%s: getaddrinfo: %s (skipping %s port %s)\n",
-                progname, gai_strerror(n), host, port);
-	return tp;
+#endif
+    if (rc) {
+        fprintf(stderr, "%s: write: %s\n", progname, strerror(errno));
+        exit(EXIT_FAILURE);
     }
+}
 
-    for (ai = ai_list, tp->num_endpoints = 0;
-         ai; ai = ai->ai_next, tp->num_endpoints++) ;
-    tp->endpoints = xcalloc(1 + tp->num_endpoints, sizeof(endpoint_t));
-
-    for (ai = ai_list, ep = tp->endpoints; ai; ai = ai->ai_next, ep++) {
-	ep->family = ai->ai_family;
-	ep->socktype = ai->ai_socktype;
-	ep->protocol = ai->ai_protocol;
-	memcpy(&ep->addr, ai->ai_addr, ai->ai_addrlen);
-	ep->addrlen = ai->ai_addrlen;
-	ep->values = xcalloc(nqueries, sizeof(unsigned int));
-	if (dmode) {
-	    char revname[NI_MAXHOST];
-	    int n;
-	    revname[0] = 0;
-	    if (canonname != NULL) {
-		ep->canonname = strdup(canonname);
-	    } else {
-		ep->canonname = strdup(host);
-	    }
-
-	    n = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-			    revname, sizeof(revname), NULL, 0,
-			    NI_NAMEREQD);
-	    if (n && n != EAI_NONAME) {
-		fprintf(stderr, "%s: getnameinfo: %s\n",
-			progname, gai_strerror(n));
-	    } else {
-		if (strlen(revname)) {
-		    ep->reversename = strdup(revname);
-		}
-	    }
-	}
-    }
+/*
+ * The source of an endpoint as shown in the reports: in parentheses
+ * after the address for human readers and as an additional field after
+ * the address in the machine readable output. Both are empty without
+ * sources.
+ */
 
-    freeaddrinfo(ai_list);
-    free(canonname); canonname = NULL;
+static const char *
+source_tag(endpoint_t *ep)
+{
+    return ep->source ? ep->source->tag : "";
+}
 
-    return tp;
+static const char *
+source_field(endpoint_t *ep)
+{
+    return ep->source ? ep->source->field : "";
 }
 
+
 /*
- * Generate the file descriptor set for all sockets with a pending
- * asynchronous connect(). If the struct timeval argument is a valid
- * pointer, leave the smallest timestamp of a socket with a pending
- * asynchronous connect in the struct timeval.
+ * Report the kernel RTT of each successful connection attempt of an
+ * endpoint below its connection setup times (-k), followed by the
+ * number of SYN retransmits if there were any.
  */
 
-static int
-generate_fdset(target_t *targets, fd_set *fdset, struct timeval *to)
+static void
+report_kinfo(endpoint_t *ep)
 {
-    int max;
-    target_t *tp;
-    endpoint_t *ep;
-
-    if (to) {
-        timerclear(to);
-    }
-    FD_ZERO(fdset);
-    for (tp = targets, max = -1; target_valid(tp); tp = tp->next) {
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-            if (ep->state == EP_STATE_CONNECTING) {
-                FD_SET(ep->socket, fdset);
-                if (ep->socket > max) {
-                    max = ep->socket;
-                }
-                if (to) {
-                    if (! timerisset(to) || timercmp(&ep->tvs, to, <)) {
-                        *to = ep->tvs;
-                    }
-                }
-            }
+    unsigned int i, retrans = 0;
+
+    printf(" %-41s", "  [rtt]");
+    for (i = 0; i < ep->idx; i++) {
+        if (ep->values[i] >= 0 && ep->ki_values[i].valid) {
+            printf(" %4u.%03u",
+                   ep->ki_values[i].rtt / 1000,
+                   ep->ki_values[i].rtt % 1000);
+            retrans += ep->ki_values[i].retrans;
+        } else {
+            printf("     *   ");
         }
     }
-
-    return max;
+    if (retrans) {
+        printf(" (%u SYN retransmits)", retrans);
+    }
+    printf("\n");
 }
 
 /*
- * Go through all endpoints and check which ones have timed out, for
- * which ones the asynchronous connect() has finished and update the
- * stats accordingly.
+ * Report the results. For each endpoint of a target, we show the time
+ * measured to establish a connection. This default format is intended
+ * primarily for human readers.
  */
 
 static void
-update(target_t *targets, fd_set *fdset)
+report(happy_t *h)
 {
-    struct timeval tv, td;
-    int soerror;
-    socklen_t soerrorlen = sizeof(soerror);
+    int i, n, len;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
     target_t *tp;
     endpoint_t *ep;
-    unsigned int us;
 
-    assert(targets && fdset);
+    assert(h);
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+
+        printf("%s%s:%s\n",
+               (tp != h->targets) ? "\n" : "", tp->host, tp->port);
 
-    (void) gettimeofday(&tv, NULL);
+        for (i = 0; tp->raced && i < 2; i++) {
+            printf(" [%s]%n", i == RACE_AAAA ? "AAAA" : "A", &len);
+            printf("%*s", (42-len), "");
+            if (tp->race[i] >= 0) {
+                printf(" %4u.%03u (%d)\n", tp->race[i] / 1000,
+                       tp->race[i] % 1000, tp->race_answers[i]);
+            } else {
+                printf("     *   \n");
+            }
+        }
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
         for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-            /* calculate time since we started the connect */
-            timersub(&tv, &ep->tvs, &td);
-            us = td.tv_sec*1000000 + td.tv_usec;
-            if (ep->state == EP_STATE_CONNECTING && us >= timeout * 1000) {
-                ep->values[ep->idx] = -us;
-                ep->idx++;
-                ep->cnt++;
-                (void) close(ep->socket);
-                ep->socket = 0;
-                ep->state = EP_STATE_TIMEDOUT;
+
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
                 continue;
             }
-            if (ep->state == EP_STATE_CONNECTING
-                && FD_ISSET(ep->socket, fdset)) {
-                if (-1 == getsockopt(ep->socket, SOL_SOCKET, SO_ERROR,
-                                     &soerror, &soerrorlen)) {
-                    fprintf(stderr, "%s: getsockopt: %s\n",
-                            progname, strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-                if (! soerror) {
-                    ep->values[ep->idx] = us;
-                    ep->sum += us;
-                    ep->tot++;
-                    ep->cnt++;
-                    ep->idx++;
+            printf(" %s%s%n", host, source_tag(ep), &len);
+            printf("%*s", (42-len), "");
+            for (i = 0; i < ep->idx; i++) {
+                if (ep->values[i] >= 0) {
+                    printf(" %4u.%03u",
+                           ep->values[i] / 1000,
+                           ep->values[i] % 1000);
                 } else {
-                    ep->values[ep->idx] = -us;
-                    ep->cnt++;
-                    ep->idx++;
-                }
-                if (! pmode) {
-                    (void) close(ep->socket);
-                    ep->socket = 0;
+                    printf("     *   ");
                 }
-                ep->state = EP_STATE_CONNECTED;
+            }
+            if (h->ci_pct && ! ep->tot && ep->soerror) {
+                printf(" (%s)", strerror(ep->soerror));
+            }
+            printf("\n");
+            if (h->kmode) {
+                report_kinfo(ep);
             }
         }
     }
 }
 
 /*
- * For all endpoints, create a socket and start a non-blocking
- * connect(). In order to avoid creating bursts of TCP SYN packets,
- * we take a short nap before each connect() call. Note that
- * asynchronous connect()s might actually succeed during the
- * short nap.
+ * Report the throughput of each parallel connection of an endpoint
+ * (-P) below its totals.
  */
 
 static void
-prepare(target_t *targets)
+report_streams(happy_t *h, endpoint_t *ep)
 {
-    int rc, flags;
-    fd_set fdset;
-    target_t *tp;
-    endpoint_t *ep;
-    struct timeval dts, dtn, dtd, dd;
+    int i, len;
+    char label[32];
+    stream_t *sp;
+
+    for (i = 0; ep->streams && i < h->nstreams; i++) {
+        sp = &ep->streams[i];
+        snprintf(label, sizeof(label), "  [stream %d]", i + 1);
+        printf(" %s%n", label, &len);
+        printf("%*s", (42-len), "");
+        printf(" %4llu.%03llu [sent]",
+               sp->send / h->pump_timeout * 1000 / 1000,
+               sp->send / h->pump_timeout * 1000 % 1000);
+        printf(" %4llu.%03llu [rcvd]",
+               sp->rcvd / h->pump_timeout * 1000 / 1000,
+               sp->rcvd / h->pump_timeout * 1000 % 1000);
+        if (h->kmode) {
+            printf(" %4llu.%03llu [rate] %u [retrans]",
+                   sp->ki_rate / 1000, sp->ki_rate % 1000,
+                   sp->ki_retrans);
+        }
+        if (h->depth) {
+            printf(" %llu [resp]", sp->responses);
+        }
+        printf("\n");
+    }
+}
 
-    assert(targets);
+/*
+ * Sum up the upload throughput (-U) of all endpoints of an address
+ * family, in the unit of the pump values. Returns the number of
+ * endpoints pumped.
+ */
 
-    dd.tv_sec = delay / 1000;
-    dd.tv_usec = (delay % 1000) * 1000;
+static unsigned int
+upload_total(happy_t *h, int family, unsigned long long *sum)
+{
+    unsigned int n = 0;
+    target_t *tp;
+    endpoint_t *ep;
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    *sum = 0;
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
         for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-
-            if (delay) {
-                int max;
-                struct timeval to;
-
-                (void) gettimeofday(&dts, NULL);
-
-                while (1) {
-                    max = generate_fdset(targets, &fdset, NULL);
-
-                    (void) gettimeofday(&dtn, NULL);
-                    timersub(&dtn, &dts, &dtd);
-                    if (timercmp(&dd, &dtd, <)) {
-                        break;
-                    }
-
-                    timeradd(&dts, &dd, &to);
-                    timersub(&to, &dtn, &to);
-                    rc = select(1 + max, NULL, &fdset, NULL, &to);
-                    if (rc == -1) {
-                        fprintf(stderr, "%s: select failed: %s\n",
-                                progname, strerror(errno));
-                        exit(EXIT_FAILURE);
-                    }
-                    update(targets, &fdset);
-                }
+            if (ep->family == family && ep->streams) {
+                *sum += ep->send / h->pump_timeout * 1000;
+                n++;
             }
-
-            ep->socket = socket(ep->family, ep->socktype, ep->protocol);
-            if (ep->socket < 0) {
-                switch (errno) {
-                    case EAFNOSUPPORT:
-                    case EPROTONOSUPPORT:
-                        continue;
-
-                    default:
-                        fprintf(stderr, "%s: socket: %s (skipping %s port %s)\n",
-                                progname, strerror(errno), tp->host, tp->port);
-                        ep->socket = 0;
-                        ep->state = EP_STATE_FAILED;
-                        continue;
-                }
-            }
-
-            flags = fcntl(ep->socket, F_GETFL, 0);
-            if (fcntl(ep->socket, F_SETFL, flags | O_NONBLOCK) == -1) {
-                fprintf(stderr, "%s: fcntl: %s (skipping %s port %s)\n",
-                        progname, strerror(errno), tp->host, tp->port);
-                (void) close(ep->socket);
-                ep->socket = 0;
-                ep->state = EP_STATE_FAILED;
-                continue;
-            }
-
-            if (connect(ep->socket,
-                        (struct sockaddr *) &ep->addr,
-                        ep->addrlen) == -1) {
-                if (errno != EINPROGRESS) {
-                    fprintf(stderr, "%s: connect: %s (skipping %s port %s)\n",
-                            progname, strerror(errno), tp->host, tp->port);
-                    (void) close(ep->socket);
-                    ep->socket = 0;
-                    ep->state = EP_STATE_FAILED;
-                    continue;
-                }
-            }
-
-            ep->state = EP_STATE_CONNECTING;
-            (void) gettimeofday(&ep->tvs, NULL);
         }
     }
+    return n;
 }
 
-
 /*
- * Wait in a select() loop for any pending connect() requests to
- * complete. If the connect() was successful, collect basic timing
- * statistics.
+ * Report the pump results. For each endpoint of a target, we show the
+ * bytes/seconds send and received.
  */
 
 static void
-collect(target_t *targets)
+report_pump(happy_t *h)
 {
-    int rc, max;
-    fd_set fdset;
-    struct timeval to, ts, tn;
-
-    assert(targets);
+    int i, n, len;
+    unsigned long long sum;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
 
-    while (1) {
+    assert(h);
 
-        if (timeout) {
-            to.tv_sec = timeout / 1000;
-            to.tv_usec = (timeout % 1000) * 1000;
-        }
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
 
-        max = generate_fdset(targets, &fdset, timeout ? &ts : NULL);
-        if (max == -1) {
-            break;
-        }
+        printf("%s%s:%s\n",
+               (tp != h->targets) ? "\n" : "", tp->host, tp->port);
 
-        if (timeout) {
-            (void) gettimeofday(&tn, NULL);
-            timeradd(&ts, &to, &to);
-            timersub(&to, &tn, &to);
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+            printf(" %s%s%n", host, source_tag(ep), &len);
+            printf("%*s", (42-len), "");
+            printf(" %4llu.%03llu [sent]",
+                   ep->send / h->pump_timeout * 1000 / 1000,
+                   ep->send / h->pump_timeout * 1000 % 1000);
+            printf(" %4llu.%03llu [rcvd]",
+                   ep->rcvd / h->pump_timeout * 1000 / 1000,
+                   ep->rcvd / h->pump_timeout * 1000 % 1000);
+            if (h->kmode) {
+                printf(" %4llu.%03llu [rate] %u [retrans]",
+                       ep->ki_rate / 1000, ep->ki_rate % 1000,
+                       ep->ki_retrans);
+            }
+            if (h->depth) {
+                printf(" %llu [resp]", ep->responses);
+            }
+            printf("\n");
+            if (h->nstreams > 1) {
+                report_streams(h, ep);
+            }
         }
+    }
 
-        rc = select(1 + max, NULL, &fdset, NULL, timeout ? &to : NULL);
-        if (rc == -1) {
-            fprintf(stderr, "%s: select failed: %s\n",
-                    progname, strerror(errno));
-            exit(EXIT_FAILURE);
+    for (i = 0; h->upmode && i < 2; i++) {
+        n = upload_total(h, i ? AF_INET6 : AF_INET, &sum);
+        if (! n) {
+            continue;
         }
-
-        update(targets, &fdset);
+        printf("%s [%s upload, %d endpoint%s]%n", i ? "" : "\n",
+               i ? "IPv6" : "IPv4", n, n == 1 ? "" : "s", &len);
+        printf("%*s", (42-len), "");
+        printf(" %4llu.%03llu [sent]\n", sum / 1000, sum % 1000);
     }
 }
 
 /*
- * Sort the results for each target. This is in particular useful for
- * interactive usage.
+ * The TCP Fast Open cookie status of an endpoint: "acked" if data sent
+ * with the SYN was acknowledged, "rejected" if it was sent with the
+ * SYN but not acknowledged, "none" if no cookie was available.
  */
 
-static int
-cmp(const void *a, const void *b)
-{
-    endpoint_t *pa = (endpoint_t *) a;
-    endpoint_t *pb = (endpoint_t *) b;
-
-    if (! pa->tot || ! pb->tot) {
-        return 0;
-    }
-
-    if (pa->sum/pa->tot < pb->sum/pb->tot) {
-        return -1;
-    } else if (pa->sum/pa->tot > pb->sum/pb->tot) {
-        return 1;
-    }
-    return 0;
-}
-
-static void
-sort(target_t *targets)
+static const char *
+fastopen_status(endpoint_t *ep)
 {
-    target_t *tp;
-    endpoint_t *ep;
-
-    assert(targets);
-
-    for (tp = targets; target_valid(tp); tp = tp->next) {
-        if (tp->endpoints) {
-            qsort(tp->endpoints, tp->num_endpoints, sizeof(*ep), cmp);
-        }
+    if (ep->fo_acked) {
+        return "acked";
     }
+    return ep->fo_syn ? "rejected" : "none";
 }
 
 /*
- * Report the results. For each endpoint of a target, we show the time
- * measured to establish a connection. This default format is intended
- * primarily for human readers.
+ * Report the TCP Fast Open results. For each endpoint of a target, we
+ * show the average time to first byte without and with TFO and the
+ * cookie status. The average time saved by TFO is shown per address
+ * family at the end.
  */
 
 static void
-report(target_t *targets)
+report_fastopen(happy_t *h)
 {
-    int i, n, len;
+    int n, len, f;
     char host[NI_MAXHOST];
     char serv[NI_MAXSERV];
     target_t *tp;
     endpoint_t *ep;
+    long long saved[2] = { 0, 0 };
+    unsigned int num[2] = { 0, 0 };
+    unsigned int plain, tfo;
+    static const char *families[2] = { "IPv4", "IPv6" };
 
-    assert(targets);
+    assert(h);
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
 
         printf("%s%s:%s\n",
-               (tp != targets) ? "\n" : "", tp->host, tp->port);
+               (tp != h->targets) ? "\n" : "", tp->host, tp->port);
 
         for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-
             n = getnameinfo((struct sockaddr *) &ep->addr,
                             ep->addrlen,
                             host, sizeof(host), serv, sizeof(serv),
@@ -808,42 +556,59 @@ report(target_t *targets)
                         progname, gai_strerror(n));
                 continue;
             }
-            printf(" %s%n", host, &len);
+            printf(" %s%s%n", host, source_tag(ep), &len);
             printf("%*s", (42-len), "");
-            for (i = 0; i < ep->idx; i++) {
-                if (ep->values[i] >= 0) {
-                    printf(" %4u.%03u",
-                           ep->values[i] / 1000,
-                           ep->values[i] % 1000);
-                } else {
-                    printf("     *   ");
-                }
+            if (! ep->fo_tot[FO_PLAIN] || ! ep->fo_tot[FO_TFO]) {
+                printf("     *    [plain]      *    [tfo] %s\n",
+                       fastopen_status(ep));
+                continue;
             }
-            printf("\n");
+            plain = ep->fo_sum[FO_PLAIN] / ep->fo_tot[FO_PLAIN];
+            tfo = ep->fo_sum[FO_TFO] / ep->fo_tot[FO_TFO];
+            printf(" %4u.%03u [plain] %4u.%03u [tfo] %s %u/%u\n",
+                   plain / 1000, plain % 1000, tfo / 1000, tfo % 1000,
+                   fastopen_status(ep), ep->fo_acked, ep->fo_tot[FO_TFO]);
+            f = (ep->family == AF_INET6);
+            saved[f] += (long long) plain - tfo;
+            num[f]++;
+        }
+    }
+
+    printf("\n");
+    for (f = 0; f < 2; f++) {
+        if (num[f]) {
+            saved[f] /= num[f];
+            printf(" %-41s %s%lld.%03lld [saved]\n", families[f],
+                   saved[f] < 0 ? "-" : " ",
+                   llabs(saved[f]) / 1000, llabs(saved[f]) % 1000);
         }
     }
 }
 
+#ifdef HAVE_OPENSSL
+
 /*
- * Report the pump results. For each endpoint of a target, we show the
- * bytes/seconds send and received.
+ * Report the TLS results. For each endpoint of a target, we show the
+ * time measured for each TLS handshake (on top of the TCP connection
+ * establishment time shown by report()) and the protocol version.
+ * Resumed handshakes are marked with an 'r'.
  */
 
 static void
-report_pump(target_t *targets)
+report_tls(happy_t *h)
 {
-    int n, len;
+    int i, n, len;
     char host[NI_MAXHOST];
     char serv[NI_MAXSERV];
     target_t *tp;
     endpoint_t *ep;
 
-    assert(targets);
+    assert(h);
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
 
         printf("%s%s:%s\n",
-               (tp != targets) ? "\n" : "", tp->host, tp->port);
+               (tp != h->targets) ? "\n" : "", tp->host, tp->port);
 
         for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
             n = getnameinfo((struct sockaddr *) &ep->addr,
@@ -855,26 +620,35 @@ report_pump(target_t *targets)
                         progname, gai_strerror(n));
                 continue;
             }
-            printf(" %s%n", host, &len);
+            printf(" %s%s%n", host, source_tag(ep), &len);
             printf("%*s", (42-len), "");
-            printf(" %4u.%03u [sent]",
-                   ep->send / pump_timeout * 1000 / 1000,
-                   ep->send / pump_timeout * 1000 % 1000);
-            printf(" %4u.%03u [rcvd]",
-                   ep->rcvd / pump_timeout * 1000 / 1000,
-                   ep->rcvd / pump_timeout * 1000 % 1000);
+            for (i = 0; i < ep->hs_idx; i++) {
+                if (ep->hs_values[i] >= 0) {
+                    printf(" %4u.%03u%c",
+                           ep->hs_values[i] / 1000,
+                           ep->hs_values[i] % 1000,
+                           ep->hs_resumed[i] ? 'r' : ' ');
+                } else {
+                    printf("     *    ");
+                }
+            }
+            if (ep->hs_version) {
+                printf(" [%s]", ep->hs_version);
+            }
             printf("\n");
         }
     }
 }
 
+#endif
+
 /*
  * Report the dns results. For each endpoint of a target, we show the
  * canonical name and the reverse name.
  */
 
 static void
-report_dns(target_t *targets)
+report_dns(happy_t *h)
 {
     int n, len;
     char host[NI_MAXHOST];
@@ -882,12 +656,12 @@ report_dns(target_t *targets)
     target_t *tp;
     endpoint_t *ep;
 
-    assert(targets);
+    assert(h);
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
 
 	printf("%s%s:%s\n",
-	       (tp != targets) ? "\n" : "", tp->host, tp->port);
+	       (tp != h->targets) ? "\n" : "", tp->host, tp->port);
 
 	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
 	    n = getnameinfo((struct sockaddr *) &ep->addr,
@@ -914,7 +688,7 @@ report_dns(target_t *targets)
  */
 
 static void
-report_sk(target_t *targets)
+report_sk(happy_t *h, FILE *out)
 {
     int i, n;
     char host[NI_MAXHOST];
@@ -923,15 +697,22 @@ report_sk(target_t *targets)
     endpoint_t *ep;
     time_t now;
 
-    assert(targets);
+    assert(h);
 
     now = time(NULL);
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+
+        for (i = 0; tp->raced && i < 2; i++) {
+            fprintf(out, "RESOLV.0.4;%lu;%s;%s;%s;%s;%d;%d\n",
+                    now, tp->race[i] >= 0 ? "OK" : "FAIL", tp->host, tp->port,
+                    i == RACE_AAAA ? "AAAA" : "A",
+                    tp->race[i], tp->race_answers[i]);
+        }
 
 	if (! tp->endpoints) {
-            printf("HAPPY.0.4;%lu;%s;%s;%s\n",
-                   now, "FAIL", tp->host, tp->port);
+            fprintf(out, "HAPPY.0.4;%lu;%s;%s;%s\n",
+                    now, "FAIL", tp->host, tp->port);
 	}
 
         for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
@@ -946,12 +727,29 @@ report_sk(target_t *targets)
                 continue;
             }
 
-            printf("HAPPY.0.4;%lu;%s;%s;%s;%s",
-                   now, ep->cnt ? "OK" : "FAIL", tp->host, tp->port, host);
+            fprintf(out, "HAPPY.0.4;%lu;%s;%s;%s;%s%s",
+                    now, ep->cnt ? "OK" : "FAIL", tp->host, tp->port, host,
+                    source_field(ep));
             for (i = 0; i < ep->idx; i++) {
-                printf(";%d", ep->values[i]);
+                fprintf(out, ";%d", ep->values[i]);
             }
-            printf("\n");
+            fprintf(out, "\n");
+            if (! h->kmode) {
+                continue;
+            }
+            fprintf(out, "TCPINFO.0.4;%lu;%s;%s;%s;%s%s",
+                    now, ep->tot ? "OK" : "FAIL", tp->host, tp->port, host,
+                    source_field(ep));
+            for (i = 0; i < ep->idx; i++) {
+                if (ep->values[i] >= 0 && ep->ki_values[i].valid) {
+                    fprintf(out, ";%u/%u/%u", ep->ki_values[i].rtt,
+                            ep->ki_values[i].rttvar,
+                            ep->ki_values[i].retrans);
+                } else {
+                    fprintf(out, ";");
+                }
+            }
+            fprintf(out, "\n");
         }
     }
 }
@@ -963,24 +761,25 @@ report_sk(target_t *targets)
  */
 
 static void
-report_pump_sk(target_t *targets)
+report_pump_sk(happy_t *h, FILE *out)
 {
-    int n;
+    int i, n;
+    unsigned long long sum;
     char host[NI_MAXHOST];
     char serv[NI_MAXSERV];
     target_t *tp;
     endpoint_t *ep;
     time_t now;
 
-    assert(targets);
+    assert(h);
 
     now = time(NULL);
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
 
 	if (! tp->endpoints) {
-            printf("PUMP.0.4;%lu;%s;%s;%s\n",
-                   now, "FAIL", tp->host, tp->port);
+            fprintf(out, "PUMP.0.4;%lu;%s;%s;%s\n",
+                    now, "FAIL", tp->host, tp->port);
 	}
 
         for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
@@ -995,19 +794,163 @@ report_pump_sk(target_t *targets)
                 continue;
             }
 
-            printf("PUMP.0.4;%lu;%s;%s;%s;%s",
-                   now, ep->cnt ? "OK" : "FAIL", tp->host, tp->port, host);
-            printf(";%u.%03u",
-                   ep->send / pump_timeout * 1000 / 1000,
-                   ep->send / pump_timeout * 1000 % 1000);
-            printf(";%u.%03u",
-                   ep->rcvd / pump_timeout * 1000 / 1000,
-                   ep->rcvd / pump_timeout * 1000 % 1000);
-            printf("\n");
+            fprintf(out, "PUMP.0.4;%lu;%s;%s;%s;%s%s",
+                    now, ep->cnt ? "OK" : "FAIL", tp->host, tp->port, host,
+                    source_field(ep));
+            fprintf(out, ";%llu.%03llu",
+                    ep->send / h->pump_timeout * 1000 / 1000,
+                    ep->send / h->pump_timeout * 1000 % 1000);
+            fprintf(out, ";%llu.%03llu",
+                    ep->rcvd / h->pump_timeout * 1000 / 1000,
+                    ep->rcvd / h->pump_timeout * 1000 % 1000);
+            if (h->kmode) {
+                fprintf(out, ";%llu.%03llu;%u", ep->ki_rate / 1000,
+                        ep->ki_rate % 1000, ep->ki_retrans);
+            }
+            if (h->depth) {
+                fprintf(out, ";%llu", ep->responses);
+            }
+            fprintf(out, "\n");
+            for (i = 0; h->nstreams > 1 && ep->streams
+                     && i < h->nstreams; i++) {
+                stream_t *sp = &ep->streams[i];
+                fprintf(out, "STREAM.0.4;%lu;%s;%s;%s;%s%s;%d",
+                        now, sp->send ? "OK" : "FAIL", tp->host, tp->port,
+                        host, source_field(ep), i + 1);
+                fprintf(out, ";%llu.%03llu",
+                        sp->send / h->pump_timeout * 1000 / 1000,
+                        sp->send / h->pump_timeout * 1000 % 1000);
+                fprintf(out, ";%llu.%03llu",
+                        sp->rcvd / h->pump_timeout * 1000 / 1000,
+                        sp->rcvd / h->pump_timeout * 1000 % 1000);
+                if (h->kmode) {
+                    fprintf(out, ";%llu.%03llu;%u", sp->ki_rate / 1000,
+                            sp->ki_rate % 1000, sp->ki_retrans);
+                }
+                if (h->depth) {
+                    fprintf(out, ";%llu", sp->responses);
+                }
+                fprintf(out, "\n");
+            }
+        }
+    }
+
+    for (i = 0; h->upmode && i < 2; i++) {
+        n = upload_total(h, i ? AF_INET6 : AF_INET, &sum);
+        fprintf(out, "UPLOAD.0.4;%lu;%s;%s;%d;%llu.%03llu\n",
+                now, n ? "OK" : "FAIL", i ? "IPv6" : "IPv4", n,
+                sum / 1000, sum % 1000);
+    }
+}
+
+/*
+ * Report the TCP Fast Open results. This function produces a more
+ * compact semicolon separated output format intended for consumption
+ * by other programs. Times are average times to first byte in us.
+ */
+
+static void
+report_fastopen_sk(happy_t *h, FILE *out)
+{
+    int n;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    time_t now;
+
+    assert(h);
+
+    now = time(NULL);
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+
+	if (! tp->endpoints) {
+            fprintf(out, "TFO.0.4;%lu;%s;%s;%s\n",
+                    now, "FAIL", tp->host, tp->port);
+	}
+
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+
+            fprintf(out, "TFO.0.4;%lu;%s;%s;%s;%s%s;%s;%d;%d;%u;%u\n",
+                    now, ep->fo_tot[FO_PLAIN] && ep->fo_tot[FO_TFO]
+                    ? "OK" : "FAIL", tp->host, tp->port, host,
+                    source_field(ep), fastopen_status(ep),
+                    ep->fo_tot[FO_PLAIN]
+                    ? (int) (ep->fo_sum[FO_PLAIN] / ep->fo_tot[FO_PLAIN]) : -1,
+                    ep->fo_tot[FO_TFO]
+                    ? (int) (ep->fo_sum[FO_TFO] / ep->fo_tot[FO_TFO]) : -1,
+                    ep->fo_acked, ep->fo_tot[FO_TFO]);
+        }
+    }
+}
+
+#ifdef HAVE_OPENSSL
+
+/*
+ * Report the TLS results. This function produces a more compact
+ * semicolon separated output format intended for consumption by other
+ * programs. Resumed handshakes carry an 'r' suffix.
+ */
+
+static void
+report_tls_sk(happy_t *h, FILE *out)
+{
+    int i, n;
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    target_t *tp;
+    endpoint_t *ep;
+    time_t now;
+
+    assert(h);
+
+    now = time(NULL);
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+
+	if (! tp->endpoints) {
+            fprintf(out, "TLS.0.4;%lu;%s;%s;%s\n",
+                    now, "FAIL", tp->host, tp->port);
+	}
+
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+
+            n = getnameinfo((struct sockaddr *) &ep->addr,
+                            ep->addrlen,
+                            host, sizeof(host), serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV);
+            if (n) {
+                fprintf(stderr, "%s: getnameinfo: %s\n",
+                        progname, gai_strerror(n));
+                continue;
+            }
+
+            fprintf(out, "TLS.0.4;%lu;%s;%s;%s;%s%s;%s",
+                    now, ep->hs_version ? "OK" : "FAIL", tp->host, tp->port,
+                    host, source_field(ep),
+                    ep->hs_version ? ep->hs_version : "");
+            for (i = 0; i < ep->hs_idx; i++) {
+                fprintf(out, ";%d%s", ep->hs_values[i],
+                        ep->hs_resumed[i] ? "r" : "");
+            }
+            fprintf(out, "\n");
         }
     }
 }
 
+#endif
+
 /*
  * Report the dns results. This function produces a more compact
  * semicolon separated output format intended for consumption by other
@@ -1015,7 +958,7 @@ report_pump_sk(target_t *targets)
  */
 
 static void
-report_dns_sk(target_t *targets)
+report_dns_sk(happy_t *h, FILE *out)
 {
     int n;
     char host[NI_MAXHOST];
@@ -1024,15 +967,15 @@ report_dns_sk(target_t *targets)
     endpoint_t *ep;
     time_t now;
 
-    assert(targets);
+    assert(h);
 
     now = time(NULL);
 
-    for (tp = targets; target_valid(tp); tp = tp->next) {
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
 
 	if (! tp->endpoints) {
-            printf("DNS.0.4;%lu;%s;%s;%s\n",
-                   now, "FAIL", tp->host, tp->port);
+            fprintf(out, "DNS.0.4;%lu;%s;%s;%s\n",
+                    now, "FAIL", tp->host, tp->port);
 	}
 
 	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
@@ -1047,189 +990,215 @@ report_dns_sk(target_t *targets)
 		continue;
 	    }
 
-	    printf("DNS.0.4;%lu;%s;%s;%s;%s;%s",
-		   now, ep->cnt ? "OK" : "FAIL", tp->host, host,
-		   ep->canonname ? ep->canonname : "",
-		   ep->reversename ? ep->reversename : "");
-	    printf("\n");
+	    fprintf(out, "DNS.0.4;%lu;%s;%s;%s;%s;%s",
+ 		   now, ep->cnt ? "OK" : "FAIL", tp->host, host,
+ 		   ep->canonname ? ep->canonname : "",
+ 		   ep->reversename ? ep->reversename : "");
+	    fprintf(out, "\n");
 	}
     }
 }
 
 /*
- * Cleanup targets and release all target data structures.
+ * Report the self-instrumentation results. For each phase of the
+ * probe loop, we show how often it ran and the CPU and wall clock
+ * time spent in it; for each kind of delay added by happy itself, we
+ * show the average and the maximum.
  */
 
 static void
-cleanup(target_t *targets)
+report_instr(happy_t *h)
 {
-    target_t *tp, *np;
-    endpoint_t *ep;
+    int i;
+
+    printf("%-10s %10s %12s %12s\n", "phase", "calls", "cpu(ms)", "wall(ms)");
+    for (i = 0; i < INSTR_NUM_PHASES; i++) {
+        printf(" %-9s %10lu %8llu.%03llu %8llu.%03llu\n",
+               instr_phase_names[i], h->instr.phases[i].calls,
+               h->instr.phases[i].cpu / 1000000,
+               h->instr.phases[i].cpu / 1000 % 1000,
+               h->instr.phases[i].wall / 1000000,
+               h->instr.phases[i].wall / 1000 % 1000);
+    }
+    printf("\n%-10s %10s %12s %12s\n", "delay", "count", "avg(ms)", "max(ms)");
+    for (i = 0; i < INSTR_NUM_DELAYS; i++) {
+        unsigned long long avg = h->instr.delays[i].cnt
+            ? h->instr.delays[i].sum / h->instr.delays[i].cnt : 0;
+        printf(" %-9s %10lu %8llu.%03llu %8lu.%03lu\n",
+               instr_delay_names[i], h->instr.delays[i].cnt,
+               avg / 1000, avg % 1000,
+               h->instr.delays[i].max / 1000, h->instr.delays[i].max % 1000);
+    }
+}
 
-    assert(targets);
+/*
+ * Report the self-instrumentation results. This function produces a
+ * more compact semicolon separated output format intended for
+ * consumption by other programs. Times are in microseconds.
+ */
 
-    for (tp = targets; target_valid(tp); tp = np) {
-	np = tp->next;
-	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-	    if (ep->socket) {
-		(void) close(ep->socket);
-	    }
-	    if (ep->values) {
-		(void) free(ep->values);
-	    }
-	    if (ep->canonname) {
-		(void) free(ep->canonname);
-	    }
-	    if (ep->reversename) {
-		(void) free(ep->reversename);
-	    }
-	}
-	if (tp->endpoints) (void) free(tp->endpoints);
-	if (tp->host) (void) free(tp->host);
-	if (tp->port) (void) free(tp->port);
-	(void) free(tp);
+static void
+report_instr_sk(happy_t *h, FILE *out)
+{
+    int i;
+    time_t now;
+
+    now = time(NULL);
+
+    for (i = 0; i < INSTR_NUM_PHASES; i++) {
+        fprintf(out, "INSTR.0.4;%lu;phase;%s;%lu;%llu;%llu\n",
+                now, instr_phase_names[i], h->instr.phases[i].calls,
+                h->instr.phases[i].cpu / 1000, h->instr.phases[i].wall / 1000);
+    }
+    for (i = 0; i < INSTR_NUM_DELAYS; i++) {
+        fprintf(out, "INSTR.0.4;%lu;delay;%s;%lu;%llu;%lu\n",
+                now, instr_delay_names[i], h->instr.delays[i].cnt,
+                h->instr.delays[i].cnt
+                ? h->instr.delays[i].sum / h->instr.delays[i].cnt : 0,
+                h->instr.delays[i].max);
     }
 }
-
 /*
- * Read a list of targets from a file or standard input if the
- * filename is '-'.
+ * Parse one line of a target file: "host", "host:port", "[address]"
+ * or "[address]:port", optionally followed by a '#' comment. An IPv6
+ * address without brackets is taken as a host. Targets without a
+ * port are expanded for all ports given with -p.
  */
 
 static void
-import(const char *filename, char **ports)
+import_line(happy_t *h, const char *p, const char *end, char **ports,
+            const char *filename, unsigned int lineno)
 {
-    FILE *in;
-    char line[512], *host;
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    const char *q, *hend, *colon = NULL;
     int j;
 
-    if (! filename || strcmp(filename, "-") == 0) {
-        clearerr(stdin);
-        in = stdin;
-    } else {
-        in = fopen(filename, "r");
-        if (! in) {
-            fprintf(stderr, "%s: fopen: %s\n",
-                    progname, strerror(errno));
-            exit(EXIT_FAILURE);
-        }
+    if ((q = memchr(p, '#', end - p))) {
+        end = q;
+    }
+    while (p < end && isspace((unsigned char) *p)) p++;
+    while (end > p && isspace((unsigned char) end[-1])) end--;
+    if (p == end) {
+        return;
     }
 
-    while (fgets(line, sizeof(line), in)) {
-        host = trim(line);
-        if (*host) {
-            for (j = 0; ports[j]; j++) {
-                append(expand(host, ports[j]));
-            }
+    if (*p == '[') {
+        hend = memchr(p, ']', end - p);
+        if (! hend || (hend + 1 < end && hend[1] != ':')) {
+            goto invalid;
+        }
+        colon = (hend + 1 < end) ? hend + 1 : NULL;
+        p++;
+    } else {
+        colon = memchr(p, ':', end - p);
+        if (colon && memchr(colon + 1, ':', end - colon - 1)) {
+            colon = NULL;
         }
+        hend = colon ? colon : end;
     }
-
-    if (ferror(in)) {
-        fprintf(stderr, "%s: ferror: %s\n",
-                progname, strerror(errno));
-        exit(EXIT_FAILURE);
+    if (hend == p || hend - p >= (long) sizeof(host)
+        || (colon && (end - colon == 1
+                      || end - colon - 1 >= (long) sizeof(port)))) {
+        goto invalid;
     }
+    memcpy(host, p, hend - p);
+    host[hend - p] = 0;
 
-    if (in != stdin) {
-        fclose(in);
+    if (colon) {
+        memcpy(port, colon + 1, end - colon - 1);
+        port[end - colon - 1] = 0;
+        happy_add(h, host, port);
+    } else {
+        for (j = 0; ports[j]; j++) {
+            happy_add(h, host, ports[j]);
+        }
     }
+    return;
 
+invalid:
+    fprintf(stderr, "%s: %s:%u: invalid target (skipping)\n",
+            progname, filename, lineno);
 }
 
 /*
- * Pump connections with HTTP GET requests and measure the datarate
- * (throughput) of the stream of responses.
+ * Read a list of targets from a file or standard input if the
+ * filename is '-'. Regular files are mapped into memory, other
+ * files (pipes, terminals) are read into a buffer first.
  */
 
 static void
-pump(target_t *targets)
+import(happy_t *h, const char *filename, char **ports)
 {
-    static char const template[] =
-    "GET / HTTP/1.1\r\n"
-    "Host: %s\r\n"
-    "User-Agent: pump/0.1\r\n"
-    "Cache-Control: no-cache\r\n"
-    "Connection: Keep-Alive\r\n"
-    "\r\n";
-
-    static char *msg;
-    target_t *tp, *np;
-    endpoint_t *ep;
-    struct timeval ts, tn, td;
-    fd_set rfds, wfds;
-    char buffer[8192];
-    unsigned int us;
-    int rc;
-
-    assert(targets);
+    int fd;
+    struct stat st;
+    char *buf, *p, *end, *nl;
+    size_t len = 0, size = 0;
+    ssize_t n;
+    int mapped = 0;
+    unsigned int lineno;
 
-    /* ignore SIGPIPE, handle locally the returned EPIPE error */
-    signal(SIGPIPE, SIG_IGN);
+    if (! filename || strcmp(filename, "-") == 0) {
+        filename = "-";
+        fd = STDIN_FILENO;
+    } else {
+        fd = open(filename, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "%s: open: %s\n",
+                    progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    for (tp = targets; target_valid(tp); tp = np) {
-        np = tp->next;
-        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
-            if (ep->state != EP_STATE_CONNECTED) {
-                continue;
+    buf = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            buf = NULL;
+        } else {
+            (void) madvise(buf, st.st_size, MADV_SEQUENTIAL);
+            len = st.st_size;
+            mapped = 1;
+        }
+    }
+    if (! mapped) {
+        while (1) {
+            if (len == size) {
+                size = size ? 2 * size : 65536;
+                buf = happy_realloc(buf, size);
             }
-            msg = malloc(strlen(template)+strlen(tp->host));
-            if (! msg) {
-                fprintf(stderr, "%s: malloc failed for %s\n",
-                        progname, tp->host);
-                continue;
+            n = read(fd, buf + len, size - len);
+            if (n == 0) {
+                break;
             }
-            snprintf(msg, strlen(template)+strlen(tp->host), template, tp->host);
-
-            (void) gettimeofday(&ts, NULL);
-            us = 0;
-            while (us < pump_timeout * 1000) {
-                FD_ZERO(&rfds);
-                FD_SET(ep->socket, &rfds);
-                FD_ZERO(&wfds);
-                FD_SET(ep->socket, &wfds);
-                ssize_t sent = 0;
-                ssize_t received = 0;
-                rc = select(1 + ep->socket, &rfds, &wfds, NULL, NULL);
-                if (rc == -1) {
-                    fprintf(stderr, "%s: select failed: %s\n",
-                            progname, strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-
-                if (FD_ISSET(ep->socket, &rfds)) {
-                    received = recv(ep->socket, buffer, sizeof(buffer), 0);
-                    if(received<0) {
-                        fprintf(stderr, "recverr (%s): %s\n", tp->host, strerror(errno));
-                        if (errno == EPIPE) break;
-                    } else {
-                        ep->rcvd += received;
-                    }
-                }
-
-                if (FD_ISSET(ep->socket, &wfds)) {
-                    sent = send(ep->socket, msg, strlen(msg), 0);
-                    if(sent<0) {
-                        fprintf(stderr, "senderr (%s): %s\n", tp->host, strerror(errno));
-                        if (errno == EPIPE) break;
-                    } else {
-                        ep->send += sent;
-                    }
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
                 }
-
-                (void) gettimeofday(&tn, NULL);
-                timersub(&tn, &ts, &td);
-                us = td.tv_sec*1000000 + td.tv_usec;
-            }
-
-            if (ep->socket) {
-                (void) close(ep->socket);
+                fprintf(stderr, "%s: read: %s\n",
+                        progname, strerror(errno));
+                exit(EXIT_FAILURE);
             }
+            len += n;
+        }
+    }
 
-            free(msg);
+    for (p = buf, end = buf + len, lineno = 1; p < end; p = nl + 1, lineno++) {
+        nl = memchr(p, '\n', end - p);
+        if (! nl) {
+            nl = end;
         }
+        import_line(h, p, nl, ports, filename, lineno);
     }
-}
 
+    if (mapped) {
+        (void) munmap(buf, len);
+    } else {
+        free(buf);
+    }
+    if (fd != STDIN_FILENO) {
+        (void) close(fd);
+    }
+}
 /*
  * Here is where the fun starts. Parse the command line options and
  * run the program in the requested mode.
@@ -1238,28 +1207,40 @@ pump(target_t *targets)
 int
 main(int argc, char *argv[])
 {
-    int i, j, c, p = 0;
+    int i, j, c, p = 0, imported = 0;
     char *def_ports[] = { "80", 0 };
     char **usr_ports = NULL;
     char **ports = def_ports;
+    FILE *out = stdout;
+    happy_t *h;
+
+    h = happy_new();
+    h->progname = progname;
 
-    while ((c = getopt(argc, argv, "abcd:p:q:f:hmst:")) != -1) {
+    while ((c = getopt(argc, argv, "aAbcC:d:E:Fp:P:q:f:hIkl:LmM:r:RsS:T:t:uUw:z")) != -1) {
 	switch (c) {
 	case 'a':
-	    dmode = 1;
+	    h->dmode = 1;
+	    break;
+	case 'A':
+	    h->amode = 1;
 	    break;
 	case 'b':
-	    pmode = 1;
+	    h->pmode = 1;
 	    break;
 	case 'c':
 	    cmode = 1;
 	    break;
+	case 'U':
+	    h->upmode = 1;
+	    h->pmode = 1;
+	    break;
 	case 'd':
 	    {
 	        char *endptr;
 		int num = strtol(optarg, &endptr, 10);
 		if (num >= 0 && *endptr == '\0') {
-		    delay = num;
+		    h->delay = num;
 		} else {
 		    fprintf(stderr, "%s: invalid argument '%s' "
 			    "for option -d\n", progname, optarg);
@@ -1269,17 +1250,45 @@ main(int argc, char *argv[])
 	    break;
 	case 'p':
 	    if (! usr_ports) {
-		usr_ports = xcalloc(argc, sizeof(char *));
+		usr_ports = happy_calloc(argc, sizeof(char *));
 		ports = usr_ports;
 	    }
 	    usr_ports[p++] = optarg;
 	    break;
+	case 'P':
+	    {
+	        char *endptr;
+		int num = strtol(optarg, &endptr, 10);
+		if (num > 0 && num <= 64 && *endptr == '\0') {
+		    h->nstreams = num;
+		    h->pmode = 1;
+		} else {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -P\n", progname, optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    break;
+	case 'w':
+	    {
+	        char *endptr;
+		int num = strtol(optarg, &endptr, 10);
+		if (num > 0 && num <= 1024 && *endptr == '\0') {
+		    h->depth = num;
+		    h->pmode = 1;
+		} else {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -w\n", progname, optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    break;
 	case 'q':
 	    {
 	        char *endptr;
 		int num = strtol(optarg, &endptr, 10);
 		if (num > 0 && *endptr == '\0') {
-		    nqueries = num;
+		    h->nqueries = num;
 		} else {
 		    fprintf(stderr, "%s: invalid argument '%s' "
 			    "for option -q\n", progname, optarg);
@@ -1287,21 +1296,157 @@ main(int argc, char *argv[])
 		}
 	    }
 	    break;
+	case 'C':
+	    {
+		char *endptr;
+		int num = strtol(optarg, &endptr, 10);
+		int max = 0;
+		if (*endptr == ':') {
+		    max = strtol(endptr + 1, &endptr, 10);
+		}
+		if (num > 0 && num < 100 && max >= 0 && *endptr == '\0') {
+		    h->ci_pct = num;
+		    h->nsamples = max;
+		} else {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -C\n", progname, optarg);
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    break;
+	case 'E':
+	    if (strcmp(optarg, "select") == 0) {
+		(void) happy_engine(h, ENGINE_SELECT);
+	    } else if (strcmp(optarg, "uring") == 0) {
+		if (happy_engine(h, ENGINE_URING) == -1) {
+		    fprintf(stderr, "%s: io_uring: %s (using select)\n",
+			    progname, strerror(errno));
+		}
+	    } else {
+		fprintf(stderr, "%s: invalid argument '%s' "
+			"for option -E\n", progname, optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'T':
+#ifdef HAVE_OPENSSL
+	    if (strcmp(optarg, "full") != 0 && strcmp(optarg, "resume") != 0) {
+		fprintf(stderr, "%s: invalid argument '%s' "
+			"for option -T\n", progname, optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    if (happy_tls(h, optarg[0] == 'f' ? TLS_FULL : TLS_RESUME) == -1) {
+		exit(EXIT_FAILURE);
+	    }
+#else
+	    fprintf(stderr, "%s: TLS not supported\n", progname);
+	    exit(EXIT_FAILURE);
+#endif
+	    break;
 	case 'f':
-	    import(optarg, ports);
+	    import(h, optarg, ports);
+	    imported = 1;
+	    break;
+	case 'F':
+	    fmode = 1;
+	    break;
+	case 'I':
+	    h->imode = 1;
+	    break;
+	case 'u':
+	    h->umode = 1;
+	    break;
+	case 'k':
+#if defined(__linux__) && defined(TCP_INFO)
+	    h->kmode = 1;
+#else
+	    fprintf(stderr, "%s: TCP_INFO not supported\n", progname);
+	    exit(EXIT_FAILURE);
+#endif
+	    break;
+	case 'l':
+	    {
+		char *endptr;
+		long lo = strtol(optarg, &endptr, 10);
+		long hi = -1;
+		if (*endptr == ':') {
+		    hi = strtol(endptr + 1, &endptr, 10);
+		}
+		if (lo <= 0 || hi < lo || hi > 65535 || *endptr != '\0') {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -l\n", progname, optarg);
+		    exit(EXIT_FAILURE);
+		}
+		if (happy_ports(h, lo, hi) == -1) {
+		    fprintf(stderr, "%s: local port range not supported: %s\n",
+			    progname, strerror(errno));
+		    exit(EXIT_FAILURE);
+		}
+	    }
+	    break;
+	case 'L':
+	    h->lmode = 1;
 	    break;
 	case 'm':
 	    skmode = 1;
 	    break;
+	case 'z':
+#ifdef HAVE_ZLIB
+	    zmode = 1;
+	    break;
+#else
+	    fprintf(stderr, "%s: compressed output not supported\n", progname);
+	    exit(EXIT_FAILURE);
+#endif
+	case 'M':
+	    if (happy_metrics(h, optarg) == -1) {
+		if (errno == EINVAL) {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -M\n", progname, optarg);
+		} else {
+		    fprintf(stderr, "%s: metrics listener %s: %s\n",
+			    progname, optarg, strerror(errno));
+		}
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'r':
+	    if (happy_resolver(h, optarg) == -1) {
+		fprintf(stderr, "%s: invalid argument '%s' "
+			"for option -r\n", progname, optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case 'R':
+	    h->rmode = 1;
+	    break;
 	case 's':
 	    smode = 1;
 	    break;
+	case 'S':
+	    if (imported) {
+		/* the targets of -f have already been expanded */
+		fprintf(stderr, "%s: option -S must be given before -f\n",
+			progname);
+		exit(EXIT_FAILURE);
+	    }
+	    if (happy_source(h, optarg) == -1) {
+		if (errno == ENOTSUP) {
+		    fprintf(stderr, "%s: binding to interface '%s' "
+			    "not supported\n", progname, optarg);
+		} else {
+		    fprintf(stderr, "%s: invalid argument '%s' "
+			    "for option -S\n", progname, optarg);
+		}
+		exit(EXIT_FAILURE);
+	    }
+	    break;
 	case 't':
 	    {
 		char *endptr;
 		int num = strtol(optarg, &endptr, 10);
 		if (num > 0 && *endptr == '\0') {
-		    timeout = num;
+		    h->timeout = num;
 		} else {
 		    fprintf(stderr, "%s: invalid argument '%s' "
 			    "for option -t\n", progname, optarg);
@@ -1312,73 +1457,162 @@ main(int argc, char *argv[])
 	case 'h':
 	default: /* '?' */
 	    fprintf(stderr,
-		    "Usage: %s [-a] [-b] [-c] [-p port] [-q nqueries] "
-		    "[-t timeout] [-d delay ] [-f file] [-s] [-m] "
-		    "hostname...\n", progname);
+		    "Usage: %s [-a] [-A] [-b] [-U] [-P streams] [-w depth] [-c] "
+		    "[-C ci[:max]] [-p port] "
+		    "[-q nqueries] [-t timeout] [-R] [-d delay ] [-r resolver] [-f file] "
+		    "[-s] [-m] [-M metrics] [-I] [-k] [-E engine] [-F] [-T tls] "
+		    "[-S source] [-l lo:hi] [-L] [-u] [-z] hostname...\n", progname);
 	    exit(EXIT_FAILURE);
 	}
     }
     argc -= optind;
     argv += optind;
 
-    if (! cmode && ! pmode && ! dmode) {
+    if (! cmode && ! h->pmode && ! h->dmode) {
 	cmode = 1;
     }
 
+    if (zmode && ! skmode) {
+	fprintf(stderr, "%s: option -z requires -m\n", progname);
+	exit(EXIT_FAILURE);
+    }
+    if (h->depth && h->upmode) {
+	fprintf(stderr, "%s: options -U and -w cannot be combined\n",
+		progname);
+	exit(EXIT_FAILURE);
+    }
+    if (h->tmode && h->pmode) {
+	fprintf(stderr, "%s: options -b and -T cannot be combined\n",
+		progname);
+	exit(EXIT_FAILURE);
+    }
+    if (h->tmode && h->umode) {
+	/* handshakes depend on the server name of the target */
+	fprintf(stderr, "%s: options -u and -T cannot be combined\n",
+		progname);
+	exit(EXIT_FAILURE);
+    }
+    if (h->tmode && h->engine != ENGINE_SELECT) {
+	/* the handshakes are driven by the select() loop */
+	fprintf(stderr, "%s: -T requires the select engine (using select)\n",
+		progname);
+	(void) happy_engine(h, ENGINE_SELECT);
+    }
+
+    /* ignore SIGPIPE, handle locally the returned EPIPE error */
+    signal(SIGPIPE, SIG_IGN);
+
     for (i = 0; i < argc; i++) {
         for (j = 0; ports[j]; j++) {
-            append(expand(argv[i], ports[j]));
+            happy_add(h, argv[i], ports[j]);
         }
     }
 
-    if (targets) {
-	if (cmode || smode || skmode || pmode) {
-	    for (i = 0; i < nqueries; i++) {
-		prepare(targets);
-		collect(targets);
+    if (happy_setup(h) == -1) {
+	fprintf(stderr, "%s: setup: %s\n", progname, strerror(errno));
+	exit(EXIT_FAILURE);
+    }
+
+    if (h->targets) {
+	if (cmode || smode || skmode || h->pmode) {
+	    for (i = 0; i < h->nsamples; i++) {
+		if (h->ci_pct && i && ! happy_adapt(h)) {
+		    break;
+		}
+		happy_probe(h);
 	    }
 	}
 	if (smode) {
-	    sort(targets);
+	    happy_sort(h);
 	}
-	if (pmode) {
-	    pump(targets);
+	if (fmode && happy_fastopen(h) == -1) {
+	    fprintf(stderr, "%s: TCP Fast Open not supported\n", progname);
+	    exit(EXIT_FAILURE);
+	}
+	if (h->pmode) {
+	    happy_pump(h);
 	}
 	lock(stdout);
-	if (dmode) {
+#ifdef HAVE_ZLIB
+	if (zmode) {
+	    out = zopen(fileno(stdout));
+	}
+#endif
+	if (h->dmode) {
 	    if (skmode) {
-		report_dns_sk(targets);
+		report_dns_sk(h, out);
+		flush(out);
 	    } else {
-		report_dns(targets);
+		report_dns(h);
 	    }
 	}
 	if (cmode) {
 	    if (skmode) {
-		report_sk(targets);
+		report_sk(h, out);
+		flush(out);
 	    } else {
-		if (dmode) {
+		if (h->dmode) {
 		    printf("\n");
 		}
-		report(targets);
+		report(h);
 	    }
 	}
-	if (pmode) {
+	if (h->pmode) {
 	    if (skmode) {
-		report_pump_sk(targets);
+		report_pump_sk(h, out);
+		flush(out);
 	    } else {
 		if (cmode) {
 		    printf("\n");
 		}
-		report_pump(targets);
+		report_pump(h);
 	    }
 	}
+#ifdef HAVE_OPENSSL
+	if (h->tmode) {
+	    if (skmode) {
+		report_tls_sk(h, out);
+		flush(out);
+	    } else {
+		if (cmode) {
+		    printf("\n");
+		}
+		report_tls(h);
+	    }
+	}
+#endif
+	if (fmode) {
+	    if (skmode) {
+		report_fastopen_sk(h, out);
+		flush(out);
+	    } else {
+		if (cmode || h->pmode || h->tmode) {
+		    printf("\n");
+		}
+		report_fastopen(h);
+	    }
+	}
+	if (h->imode) {
+	    if (skmode) {
+		report_instr_sk(h, out);
+		flush(out);
+	    } else {
+		printf("\n");
+		report_instr(h);
+	    }
+	}
+	if (out != stdout && fclose(out) == EOF) {
+	    fprintf(stderr, "%s: write: %s\n", progname, strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
 	unlock(stdout);
-	cleanup(targets);
     }
 
     if (usr_ports) {
         (void) free(usr_ports);
     }
 
+    happy_free(h);
+
     return EXIT_SUCCESS;
 }
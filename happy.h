@@ -0,0 +1,419 @@
+/*
+ * happy.h --
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of the Leone Project or Jacobs University Bremen.
+ */
+
+/*
+ * The libhappy programming interface. A happy_t holds the configuration,
+ * the targets and the state of the probe engines, so that several
+ * independent instances can live in one process. The happy command
+ * line tool is a thin front end on top of this interface.
+ *
+ * Targets are added with happy_add() and prepared with happy_setup().
+ * A round of connection attempts either runs to completion in
+ * happy_probe() or, with the select engine, on the event loop of the
+ * caller: happy_start() starts the round, happy_fdset() fills the
+ * descriptor sets for select() and happy_process() consumes them until
+ * it returns 0. Samples are delivered to the sample callback as they
+ * are taken. Callers using TLS or happy_pump() should ignore SIGPIPE.
+ */
+
+#ifndef HAPPY_H
+#define HAPPY_H
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#ifndef NI_MAXHOST
+#define NI_MAXHOST	1025
+#endif
+#ifndef NI_MAXSERV
+#define NI_MAXSERV	32
+#endif
+
+#define EP_STATE_NEW		0x00
+#define EP_STATE_CONNECTING	0x01
+#define EP_STATE_CONNECTED	0x02
+#define EP_STATE_TIMEDOUT	0x04
+#define EP_STATE_FAILED		0x08
+#define EP_STATE_HANDSHAKE	0x10
+#define EP_STATE_DONE		0x20
+
+/*
+ * Local source addresses or interfaces (-S). Every endpoint is probed
+ * once from each source of its address family.
+ */
+
+typedef struct source {
+    char *name;				/* as given on the command line */
+    char *tag;				/* " (name)" for human readers */
+    char *field;			/* ";name" for machine readable output */
+    int family;				/* AF_UNSPEC for an interface */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct source *next;
+} source_t;
+
+/*
+ * Kernel view of a connection (-k), read with TCP_INFO when connect()
+ * completes. The RTT is free of our own scheduling delay and SYN
+ * retransmits explain the outliers caused by lost SYNs.
+ */
+
+typedef struct kinfo {
+    unsigned int rtt;			/* smoothed RTT in us */
+    unsigned int rttvar;		/* RTT variance in us */
+    unsigned int retrans;		/* SYN retransmits */
+    int valid;				/* TCP_INFO could be read */
+} kinfo_t;
+
+/*
+ * State of the parser that delimits the HTTP responses received on a
+ * pumped connection.
+ */
+
+typedef struct http {
+    int state;
+    int status;				/* of the current response */
+    int chunked;			/* Transfer-Encoding: chunked */
+    int length;				/* Content-Length given */
+    unsigned long long left;		/* bytes left of the body or chunk */
+    unsigned int len;			/* bytes in line */
+    char line[128];			/* header or chunk size line */
+} http_t;
+
+/*
+ * One of the parallel connections pumped for an endpoint (-P). The
+ * totals of the endpoint are the sums over its streams.
+ */
+
+typedef struct stream {
+    int conn;
+    unsigned long long send;
+    unsigned long long rcvd;
+    unsigned long long responses;	/* complete responses received */
+    unsigned long long ki_rate;		/* delivery rate in bytes/s (-k) */
+    unsigned int ki_retrans;		/* retransmits while pumping (-k) */
+    unsigned int hdr;			/* request header bytes sent */
+    unsigned int outstanding;		/* requests not yet answered */
+    int zerocopy;			/* body sent with MSG_ZEROCOPY (-U) */
+    http_t http;
+} stream_t;
+
+struct target;
+struct ssl_st;
+struct ssl_session_st;
+struct ssl_ctx_st;
+
+typedef struct endpoint {
+    int family;
+    int socktype;
+    int protocol;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char *canonname;
+    char *reversename;
+    source_t *source;
+    struct endpoint *dup;		/* endpoint probed in our place (-u) */
+    struct target *target;		/* target owning this endpoint */
+
+    int socket;
+    struct timeval tvs;
+    int state;
+
+    unsigned int sum;
+    unsigned int tot;
+    unsigned int idx;
+    unsigned int cnt;
+    int *values;
+    int soerror;			/* last error, ETIMEDOUT on timeouts */
+    struct kinfo *ki_values;		/* kernel TCP_INFO per sample (-k) */
+    unsigned int srtt;			/* smoothed RTT in us (rmode) */
+    unsigned int rttvar;		/* RTT variance in us (rmode) */
+    unsigned int backoff;		/* consecutive timeouts (rmode) */
+
+    int conn;				/* connection kept for happy_pump() */
+    unsigned long long send;
+    unsigned long long rcvd;
+    unsigned long long responses;
+    unsigned long long ki_rate;		/* delivery rate in bytes/s (-k) */
+    unsigned int ki_retrans;		/* retransmits while pumping (-k) */
+    stream_t *streams;			/* nstreams pumped connections */
+
+    unsigned int fo_sum[2];		/* time to first byte in us */
+    unsigned int fo_tot[2];
+    unsigned int fo_syn;		/* request data sent with the SYN */
+    unsigned int fo_acked;		/* request data in SYN acked */
+
+    struct ssl_st *ssl;			/* TLS state, unused without OpenSSL */
+    struct ssl_session_st *session;	/* session to resume */
+    struct timeval tvh;			/* start of the TLS handshake */
+    int want;				/* SSL_ERROR_WANT_READ or _WRITE */
+    int done;				/* handshake done, waiting for ticket */
+    int ticket;				/* got a new session */
+    unsigned int hs_idx;
+    int *hs_values;			/* handshake times, negative on failure */
+    char *hs_resumed;			/* handshake was resumed */
+    const char *hs_version;
+} endpoint_t;
+
+#define FO_PLAIN		0
+#define FO_TFO			1
+
+#define RACE_A			0
+#define RACE_AAAA		1
+
+typedef struct target {
+    char *host;
+    char *port;
+    int num_endpoints;
+    endpoint_t *endpoints;
+    int race[2];			/* A/AAAA query times, negative on failure */
+    int race_answers[2];
+    int raced;				/* race[] measured (-A) */
+    unsigned int srtt[2];		/* smoothed RTT per family (rmode) */
+    unsigned int rttvar[2];		/* RTT variance per family (rmode) */
+    struct target *next;
+} target_t;
+
+#define ENGINE_SELECT		0
+#define ENGINE_URING		1
+
+#define TLS_FULL		1
+#define TLS_RESUME		2
+
+/*
+ * Pools of pre-created sockets, one per address family, so that the
+ * socket() call is not on the paced critical path of a connect().
+ */
+
+#define POOL_SIZE		64
+#define POOL_FAMILIES		2
+
+typedef struct pool {
+    int family;
+    int want;
+    int num;
+    int fds[POOL_SIZE];
+} pool_t;
+
+/*
+ * Counters exported by the optional metrics listener (-M). They are
+ * updated by the probe engines and happy_pump() and rendered in the
+ * Prometheus text exposition format whenever a client connects.
+ */
+
+#define METRICS_MAX_CLIENTS	8
+#define METRICS_NUM_BUCKETS	11
+
+typedef struct metrics {
+    int fd;
+    int local;
+    char *path;
+    int clients[METRICS_MAX_CLIENTS];
+    struct timeval tvs;
+
+    unsigned long started;
+    unsigned long connected;
+    unsigned long failed;
+    unsigned long timedout;
+    unsigned long errors;
+    unsigned long backlog;
+
+    unsigned long hist[METRICS_NUM_BUCKETS];
+    unsigned long long hist_sum;		/* in us */
+
+    unsigned long long send;
+    unsigned long long rcvd;
+} metrics_t;
+
+/*
+ * Self-instrumentation (-I). We keep track of the CPU and wall clock
+ * time spent in the phases of the probe loop and of the delays that
+ * happy itself adds to the measured connection setup times.
+ */
+
+#define INSTR_PHASE_FDSET	0
+#define INSTR_PHASE_SELECT	1
+#define INSTR_PHASE_UPDATE	2
+#define INSTR_PHASE_CONNECT	3
+#define INSTR_NUM_PHASES	4
+
+#define INSTR_DELAY_READY	0
+#define INSTR_DELAY_PACING	1
+#define INSTR_DELAY_TIMEOUT	2
+#define INSTR_NUM_DELAYS	3
+
+typedef struct instr_mark {
+    struct timespec cpu;
+    struct timespec wall;
+} instr_mark_t;
+
+typedef struct instr {
+    struct {
+        unsigned long calls;
+        unsigned long long cpu;		/* in ns */
+        unsigned long long wall;	/* in ns */
+    } phases[INSTR_NUM_PHASES];
+    struct {
+        unsigned long cnt;
+        unsigned long long sum;		/* in us */
+        unsigned long max;		/* in us */
+    } delays[INSTR_NUM_DELAYS];
+    struct timeval select_return;
+} instr_t;
+
+typedef struct happy happy_t;
+
+/*
+ * Network backend of the select engine. Each function behaves like
+ * the system call it is named after and gets ctx as first argument.
+ * Only the probing rounds go through the backend, so a simulated
+ * network cannot be combined with -b, -F, -k, -M, -S or -T:
+ * happy_net() and happy_setup() fail with EINVAL, happy_fastopen()
+ * with ENOTSUP.
+ */
+
+typedef struct happy_net {
+    int (*socket)(void *ctx, int family, int socktype, int protocol);
+    int (*connect)(void *ctx, int fd, const struct sockaddr *addr,
+                   socklen_t addrlen);
+    int (*soerror)(void *ctx, int fd, int *soerror);
+    int (*close)(void *ctx, int fd);
+    int (*select)(void *ctx, int nfds, fd_set *rfds, fd_set *wfds,
+                  struct timeval *to);
+    int (*gettimeofday)(void *ctx, struct timeval *tv);
+    void *ctx;
+} happy_net_t;
+
+/*
+ * Called whenever a sample has been recorded for an endpoint. The
+ * value is the connection setup time in us, negated if the attempt
+ * failed or timed out, as stored in the values of the endpoint.
+ */
+
+typedef void (*happy_sample_t)(happy_t *h, target_t *tp, endpoint_t *ep,
+                               int value, void *arg);
+
+struct happy {
+    /* configuration, may be changed before happy_setup() */
+    const char *progname;		/* prefix of diagnostic messages */
+    int nqueries;
+    int nsamples;			/* samples per endpoint, at most */
+    int ci_pct;				/* 95% CI target in % of the mean */
+    int timeout;			/* in ms, upper bound with rmode */
+    unsigned int delay;			/* in ms */
+    int pump_timeout;			/* in ms */
+    int nstreams;			/* parallel connections pumped */
+    int depth;				/* pipelined requests, 0 for no limit */
+    int engine;
+    int dmode;				/* resolve reverse names */
+    int pmode;				/* keep connections for happy_pump() */
+    int upmode;				/* pump a request body upstream */
+    int tmode;				/* TLS_FULL or TLS_RESUME */
+    int amode;				/* time the A and AAAA lookups */
+    int kmode;				/* record kernel TCP_INFO */
+    int umode;				/* probe shared endpoints once */
+    int rmode;				/* adaptive connect timeouts */
+    int imode;				/* self-instrumentation */
+    int lmode;				/* abort connections with a RST */
+    unsigned int port_lo;		/* local port range, 0 for any */
+    unsigned int port_hi;
+    source_t *sources;
+    happy_sample_t sample;
+    void *arg;
+    const happy_net_t *net;		/* NULL for the system calls */
+
+    /* results */
+    target_t *targets;
+    target_t *last;
+    metrics_t metrics;
+    instr_t instr;
+
+    /* engine state */
+    unsigned int fd_budget;
+    unsigned int fd_inflight;
+    unsigned int fd_kept;		/* connections kept for happy_pump() */
+    pool_t pools[POOL_FAMILIES];
+    struct uring *uring;
+    struct ssl_ctx_st *tls_ctx;
+    target_t *cur_tp;			/* next endpoint to connect */
+    endpoint_t *cur_ep;
+    struct timeval slot;		/* earliest time of the next connect */
+};
+
+static inline int target_valid(target_t *tp) {
+    return (tp && tp->host && tp->port);
+}
+
+static inline int endpoint_valid(endpoint_t *ep) {
+    return (ep && ep->addrlen);
+}
+
+happy_t *happy_new(void);
+void happy_free(happy_t *h);
+
+int happy_source(happy_t *h, const char *name);
+int happy_resolver(happy_t *h, const char *spec);
+int happy_metrics(happy_t *h, const char *spec);
+int happy_engine(happy_t *h, int engine);
+int happy_net(happy_t *h, const happy_net_t *net);
+int happy_ports(happy_t *h, unsigned int lo, unsigned int hi);
+int happy_tls(happy_t *h, int mode);
+
+target_t *happy_add(happy_t *h, const char *host, const char *port);
+int happy_setup(happy_t *h);
+
+int happy_start(happy_t *h);
+int happy_fdset(happy_t *h, int max, fd_set *rfds, fd_set *wfds,
+                struct timeval *to);
+int happy_process(happy_t *h, fd_set *rfds, fd_set *wfds);
+void happy_probe(happy_t *h);
+int happy_adapt(happy_t *h);
+void happy_sort(happy_t *h);
+
+void happy_pump(happy_t *h);
+int happy_fastopen(happy_t *h);
+int happy_fastopen_status(void);
+
+void *happy_calloc(size_t nmemb, size_t size);
+void *happy_realloc(void *ptr, size_t size);
+
+#endif
@@ -0,0 +1,3828 @@
+/*
+ * libhappy.c --
+ *
+ * Copyright (c) 2013, Juergen Schoenwaelder, Jacobs University Bremen
+ * Copyright (c) 2014, Vaibhav Bajpai, Jacobs University Bremen
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials provided
+ *    with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and
+ * documentation are those of the authors and should not be
+ * interpreted as representing official policies, either expressed or
+ * implied, of the Leone Project or Jacobs University Bremen.
+ */
+
+#define _POSIX_C_SOURCE 2
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+
+#include <sys/types.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "happy.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL		0
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY		0
+#endif
+
+#if defined(__linux__) && ! defined(IP_LOCAL_PORT_RANGE)
+#define IP_LOCAL_PORT_RANGE	51	/* Linux 6.3 */
+#endif
+
+/*
+ * The number of sockets with a connection attempt (or TLS handshake)
+ * in flight is limited to a budget derived from RLIMIT_NOFILE (and
+ * FD_SETSIZE for the select engine); further attempts are queued
+ * until a slot frees up. Connections kept for happy_pump() (-b) count
+ * against the budget and may use at most half of it.
+ */
+
+#define FD_RESERVED		(16 + METRICS_MAX_CLIENTS + POOL_FAMILIES * POOL_SIZE)
+
+static const unsigned int metrics_buckets[METRICS_NUM_BUCKETS] = { /* in us */
+    1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000
+};
+
+/*
+ * A calloc() that exits if we run out of memory. Exported for the
+ * command line tools so that there is a single allocator.
+ */
+
+void*
+happy_calloc(size_t nmemb, size_t size)
+{
+    void *p = calloc(nmemb, size);
+    if (!p) {
+        fprintf(stderr, "happy: memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ * A realloc() that exits if we run out of memory.
+ */
+
+void*
+happy_realloc(void *ptr, size_t size)
+{
+    void *p = realloc(ptr, size);
+    if (!p) {
+        fprintf(stderr, "happy: memory allocation failure\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+
+/*
+ * Open the metrics listener. A spec containing a slash is taken as
+ * the path of a Unix domain socket, anything else as a TCP port on
+ * the loopback interface which answers HTTP requests. Returns -1 and
+ * sets errno on failure.
+ */
+
+int
+happy_metrics(happy_t *h, const char *spec)
+{
+    int fd, flags, one = 1;
+    char *endptr;
+    long port;
+
+    assert(spec);
+
+    if (strchr(spec, '/')) {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(spec) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sun.sun_path, spec);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        (void) unlink(spec);
+        if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+            goto fail;
+        }
+        h->metrics.local = 1;
+        h->metrics.path = strdup(spec);
+    } else {
+        struct sockaddr_in sin;
+
+        port = strtol(spec, &endptr, 10);
+        if (port <= 0 || port > 65535 || *endptr != '\0') {
+            errno = EINVAL;
+            return -1;
+        }
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+            goto fail;
+        }
+    }
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1
+        || listen(fd, METRICS_MAX_CLIENTS) == -1) {
+        goto fail;
+    }
+
+    h->metrics.fd = fd;
+    (void) gettimeofday(&h->metrics.tvs, NULL);
+    return 0;
+
+fail:
+    flags = errno;
+    (void) close(fd);
+    errno = flags;
+    return -1;
+}
+
+/*
+ * Record the setup time (in us) of a successful connection attempt in
+ * the metrics and the connect time histogram.
+ */
+
+static void
+metrics_observe(happy_t *h, unsigned int us)
+{
+    int i;
+
+    h->metrics.connected++;
+    h->metrics.hist_sum += us;
+    for (i = 0; i < METRICS_NUM_BUCKETS; i++) {
+        if (us <= metrics_buckets[i]) {
+            h->metrics.hist[i]++;
+        }
+    }
+}
+
+/*
+ * Render the current metrics in the Prometheus text format into a
+ * freshly allocated buffer. The caller has to free the buffer.
+ */
+
+static char *
+metrics_render(happy_t *h, size_t *len)
+{
+    FILE *f;
+    char *buf = NULL;
+    int i;
+    struct timeval tv, td;
+    unsigned long done, inflight;
+
+    f = open_memstream(&buf, len);
+    if (! f) {
+        return NULL;
+    }
+
+    (void) gettimeofday(&tv, NULL);
+    timersub(&tv, &h->metrics.tvs, &td);
+    done = h->metrics.connected + h->metrics.failed + h->metrics.timedout;
+    inflight = h->metrics.started > done ? h->metrics.started - done : 0;
+
+    fprintf(f, "# HELP happy_uptime_seconds Time since the listener was opened.\n"
+            "# TYPE happy_uptime_seconds gauge\n"
+            "happy_uptime_seconds %lu.%06lu\n",
+            (unsigned long) td.tv_sec, (unsigned long) td.tv_usec);
+    fprintf(f, "# HELP happy_connects_started_total Connection attempts started.\n"
+            "# TYPE happy_connects_started_total counter\n"
+            "happy_connects_started_total %lu\n", h->metrics.started);
+    fprintf(f, "# HELP happy_connects_total Completed connection attempts.\n"
+            "# TYPE happy_connects_total counter\n"
+            "happy_connects_total{result=\"ok\"} %lu\n"
+            "happy_connects_total{result=\"failed\"} %lu\n"
+            "happy_connects_total{result=\"timeout\"} %lu\n"
+            "happy_connects_total{result=\"error\"} %lu\n",
+            h->metrics.connected, h->metrics.failed, h->metrics.timedout,
+            h->metrics.errors);
+    fprintf(f, "# HELP happy_connects_inflight Connection attempts in progress.\n"
+            "# TYPE happy_connects_inflight gauge\n"
+            "happy_connects_inflight %lu\n", inflight);
+    fprintf(f, "# HELP happy_pacer_backlog Attempts of the current round not yet started.\n"
+            "# TYPE happy_pacer_backlog gauge\n"
+            "happy_pacer_backlog %lu\n", h->metrics.backlog);
+    fprintf(f, "# HELP happy_connect_seconds Connection setup time.\n"
+            "# TYPE happy_connect_seconds histogram\n");
+    for (i = 0; i < METRICS_NUM_BUCKETS; i++) {
+        fprintf(f, "happy_connect_seconds_bucket{le=\"%u.%06u\"} %lu\n",
+                metrics_buckets[i] / 1000000, metrics_buckets[i] % 1000000,
+                h->metrics.hist[i]);
+    }
+    fprintf(f, "happy_connect_seconds_bucket{le=\"+Inf\"} %lu\n"
+            "happy_connect_seconds_sum %llu.%06llu\n"
+            "happy_connect_seconds_count %lu\n",
+            h->metrics.connected,
+            h->metrics.hist_sum / 1000000, h->metrics.hist_sum % 1000000,
+            h->metrics.connected);
+    fprintf(f, "# HELP happy_pump_bytes_total Bytes pumped by -b.\n"
+            "# TYPE happy_pump_bytes_total counter\n"
+            "happy_pump_bytes_total{direction=\"sent\"} %llu\n"
+            "happy_pump_bytes_total{direction=\"rcvd\"} %llu\n",
+            h->metrics.send, h->metrics.rcvd);
+
+    if (fclose(f) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Add the metrics listener and all metrics clients waiting for a
+ * response to the read file descriptor set. Returns the new maximum
+ * file descriptor.
+ */
+
+static int
+metrics_fdset(happy_t *h, fd_set *rfds, int max)
+{
+    int i;
+
+    if (h->metrics.fd == -1) {
+        return max;
+    }
+
+    FD_SET(h->metrics.fd, rfds);
+    if (h->metrics.fd > max) {
+        max = h->metrics.fd;
+    }
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (h->metrics.clients[i] > 0) {
+            FD_SET(h->metrics.clients[i], rfds);
+            if (h->metrics.clients[i] > max) {
+                max = h->metrics.clients[i];
+            }
+        }
+    }
+    return max;
+}
+
+/*
+ * Send the rendered metrics to a client and close the connection.
+ * HTTP clients get a minimal HTTP/1.0 response header.
+ */
+
+static void
+metrics_respond(happy_t *h, int fd)
+{
+    char *buf, hdr[128];
+    size_t len = 0;
+    int n;
+
+    buf = metrics_render(h, &len);
+    if (buf) {
+        if (! h->metrics.local) {
+            n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\n\r\n", len);
+            (void) send(fd, hdr, n, MSG_NOSIGNAL);
+        }
+        (void) send(fd, buf, len, MSG_NOSIGNAL);
+        free(buf);
+    }
+    (void) close(fd);
+}
+
+/*
+ * Accept new metrics clients and answer the ones that are readable.
+ * Unix domain socket clients are answered right away, HTTP clients
+ * once their request has arrived.
+ */
+
+static void
+metrics_serve(happy_t *h, fd_set *rfds)
+{
+    int i, fd, flags;
+    char buf[1024];
+
+    if (h->metrics.fd == -1) {
+        return;
+    }
+
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        fd = h->metrics.clients[i];
+        if (fd > 0 && FD_ISSET(fd, rfds)) {
+            (void) recv(fd, buf, sizeof(buf), 0);
+            metrics_respond(h, fd);
+            h->metrics.clients[i] = 0;
+        }
+    }
+
+    if (! FD_ISSET(h->metrics.fd, rfds)) {
+        return;
+    }
+
+    while ((fd = accept(h->metrics.fd, NULL, NULL)) != -1) {
+        if (h->metrics.local) {
+            metrics_respond(h, fd);
+            continue;
+        }
+        flags = fcntl(fd, F_GETFL, 0);
+        (void) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        for (i = 0; i < METRICS_MAX_CLIENTS && h->metrics.clients[i] > 0; i++) ;
+        if (i == METRICS_MAX_CLIENTS) {
+            (void) close(fd);
+            continue;
+        }
+        h->metrics.clients[i] = fd;
+    }
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/*
+ * Serve pending metrics clients without blocking. This is used by
+ * event loops that do not wait in select().
+ */
+
+static void
+metrics_poll(happy_t *h)
+{
+    fd_set rfds;
+    int max;
+    struct timeval to = { 0, 0 };
+
+    if (h->metrics.fd == -1) {
+        return;
+    }
+    FD_ZERO(&rfds);
+    max = metrics_fdset(h, &rfds, -1);
+    if (select(1 + max, &rfds, NULL, NULL, &to) > 0) {
+        metrics_serve(h, &rfds);
+    }
+}
+
+#endif
+
+/*
+ * Close the metrics listener and all pending metrics clients.
+ */
+
+static void
+metrics_close(happy_t *h)
+{
+    int i;
+
+    if (h->metrics.fd == -1) {
+        return;
+    }
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (h->metrics.clients[i] > 0) {
+            (void) close(h->metrics.clients[i]);
+            h->metrics.clients[i] = 0;
+        }
+    }
+    (void) close(h->metrics.fd);
+    h->metrics.fd = -1;
+    if (h->metrics.path) {
+        (void) unlink(h->metrics.path);
+        free(h->metrics.path);
+        h->metrics.path = NULL;
+    }
+}
+
+/*
+ * The system calls of the probing rounds go through the network
+ * backend (happy_net()) if one is set, e.g. a simulated network with
+ * a virtual clock.
+ */
+
+static int
+net_time(happy_t *h, struct timeval *tv)
+{
+    return h->net ? h->net->gettimeofday(h->net->ctx, tv)
+        : gettimeofday(tv, NULL);
+}
+
+static int
+net_connect(happy_t *h, int fd, const struct sockaddr *addr,
+            socklen_t addrlen)
+{
+    return h->net ? h->net->connect(h->net->ctx, fd, addr, addrlen)
+        : connect(fd, addr, addrlen);
+}
+
+static int
+net_soerror(happy_t *h, int fd, int *soerror)
+{
+    socklen_t soerrorlen = sizeof(*soerror);
+
+    return h->net ? h->net->soerror(h->net->ctx, fd, soerror)
+        : getsockopt(fd, SOL_SOCKET, SO_ERROR, soerror, &soerrorlen);
+}
+
+static int
+net_close(happy_t *h, int fd)
+{
+    return h->net ? h->net->close(h->net->ctx, fd) : close(fd);
+}
+
+static int
+net_select(happy_t *h, int nfds, fd_set *rfds, fd_set *wfds,
+           struct timeval *to)
+{
+    return h->net ? h->net->select(h->net->ctx, nfds, rfds, wfds, to)
+        : select(nfds, rfds, wfds, NULL, to);
+}
+
+/*
+ * Start measuring a phase of the probe loop. This is a no-op unless
+ * self-instrumentation has been requested.
+ */
+
+static void
+instr_begin(happy_t *h, instr_mark_t *m)
+{
+    if (h->imode) {
+        (void) clock_gettime(CLOCK_THREAD_CPUTIME_ID, &m->cpu);
+        (void) clock_gettime(CLOCK_MONOTONIC, &m->wall);
+    }
+}
+
+/*
+ * Finish measuring a phase of the probe loop and account the CPU and
+ * wall clock time elapsed since the matching instr_begin().
+ */
+
+static void
+instr_end(happy_t *h, int phase, instr_mark_t *m)
+{
+    struct timespec cpu, wall;
+
+    if (! h->imode) {
+        return;
+    }
+    (void) clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    (void) clock_gettime(CLOCK_MONOTONIC, &wall);
+    h->instr.phases[phase].calls++;
+    h->instr.phases[phase].cpu += (cpu.tv_sec - m->cpu.tv_sec) * 1000000000LL
+        + (cpu.tv_nsec - m->cpu.tv_nsec);
+    h->instr.phases[phase].wall += (wall.tv_sec - m->wall.tv_sec) * 1000000000LL
+        + (wall.tv_nsec - m->wall.tv_nsec);
+}
+
+/*
+ * Account a delay (in us) that happy added to a measurement.
+ */
+
+static void
+instr_delay(happy_t *h, int kind, long us)
+{
+    if (! h->imode) {
+        return;
+    }
+    if (us < 0) {
+        us = 0;
+    }
+    h->instr.delays[kind].cnt++;
+    h->instr.delays[kind].sum += us;
+    if (us > h->instr.delays[kind].max) {
+        h->instr.delays[kind].max = us;
+    }
+}
+
+/*
+ * Remember when select() returned so that update() can tell how long
+ * it took until a ready socket got its timestamp.
+ */
+
+static void
+instr_select_return(happy_t *h)
+{
+    if (h->imode) {
+        (void) net_time(h, &h->instr.select_return);
+    }
+}
+
+/*
+ * Append a new target to our list of targets. We keep track of
+ * the last target added so that we do not have to search for the
+ * end of the list.
+ */
+
+static void
+append(happy_t *h, target_t *target)
+{
+    endpoint_t *ep;
+
+    if (target) {
+        if (! h->targets) {
+            h->targets = target;
+        } else {
+            h->last->next = target;
+        }
+        h->last = target;
+        for (ep = target->endpoints; endpoint_valid(ep); ep++) {
+            ep->target = target;
+        }
+    }
+}
+
+/*
+ * Handler to parse DNS response messages; particularly CNAME
+ * answers. This is used because getaddrinfo(...) and AI_CANONNAME
+ * cannot be used with the glibc version on SamKnows probes. The
+ * version returns PTR entries when asked for a CNAME. Therefore
+ * explicit CNAME query request needs to be made and a handler
+ * function is needed to parse CNAME responses.
+ */
+
+static char*
+parse_cname_response(const u_char* const answer, const int answerlen)
+{
+
+    /* initialize data structure to store the parsed response */
+    ns_msg handle;
+    if (
+	ns_initparse(
+	    answer,     /* answer buffer */
+	    answerlen,  /* true answer length */
+	    &handle     /* data structure filled in by ns_initparse */
+	    ) < 0
+	) {
+	herror("ns_initparse(...)");
+	exit(EXIT_FAILURE);
+    }
+    
+    /* Ideally one would iterate over each resource record returned by
+     * ns_msg_count(...). However, this is a specific parse function for CNAME
+     * records and because a RR cannot have any other records along with a
+     * CNAME [RFC 1912], there is no need to iterate in a loop, but only once,
+     * therefore rrnum is set to 0 */
+    
+    ns_rr rr; int rrnum = 0;
+    
+    /* parse the answer section of the resource record */
+    if (
+	ns_parserr(
+	    &handle, /* data structure filled by ns_initparse */
+	    ns_s_an, /* resource record answer section */
+	    rrnum,   /* resource record index in this section */
+	    &rr      /* data structure filled in by ns_parseerr */
+	    ) < 0
+	) {
+	
+	/* continue to the next resource records if this cannot be parsed */
+	if (errno != ENODEV) {
+	    herror("ns_parserr(...)");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    
+    char* dst = NULL;
+    switch (ns_rr_type(rr)) {
+	
+	/* type: CNAME record */
+    case ns_t_cname:
+	dst = (char *) happy_calloc (1, NI_MAXHOST);
+	
+	/* Uncompress the DNS string */
+	if (
+	    ns_name_uncompress(
+		ns_msg_base(handle) /* Message Start */
+		, ns_msg_end(handle)  /* Message End */
+		, ns_rr_rdata(rr)     /* Message Position */
+		, dst                 /* Result */
+		, NI_MAXHOST          /* Result Size */
+		) < 0
+	    ) {
+	    (void) fprintf(stderr, "ns_name_uncompress failed\n");
+	    free(dst); dst = NULL;
+	    exit(EXIT_FAILURE);
+	}
+	
+	break;
+	
+	/* ignore all the other types */
+    default:
+	break;
+    }
+    
+    return dst;
+}
+
+/*
+ * Point the stub resolver to a specific name server instead of the
+ * ones listed in resolv.conf. The argument is an IPv4 address,
+ * optionally followed by '#' and a port number. This is mainly
+ * useful to run against a local (stub) name server. Note that the
+ * stub resolver state belongs to the C library and is shared by all
+ * instances. Returns -1 if the argument is invalid.
+ */
+
+int
+happy_resolver(happy_t *h, const char *spec)
+{
+    char *addr, *port, *endptr;
+    struct in_addr in;
+    long num = NS_DEFAULTPORT;
+
+    assert(spec);
+
+    addr = strdup(spec);
+    port = strchr(addr, '#');
+    if (port) {
+        *port++ = '\0';
+        num = strtol(port, &endptr, 10);
+    }
+    if (inet_pton(AF_INET, addr, &in) != 1
+        || (port && (*endptr != '\0' || num <= 0 || num > 65535))) {
+        free(addr);
+        errno = EINVAL;
+        return -1;
+    }
+    free(addr);
+
+    if (res_init() == -1) {
+        return -1;
+    }
+#ifdef __GLIBC__
+    /*
+     * glibc keeps an IPv6 address of a name server in a separate slot
+     * and prefers it; drop it so that the address below is used.
+     */
+    if (_res._u._ext.nsaddrs[0]) {
+        free(_res._u._ext.nsaddrs[0]);
+        _res._u._ext.nsaddrs[0] = NULL;
+    }
+#endif
+    memset(&_res.nsaddr_list[0], 0, sizeof(_res.nsaddr_list[0]));
+    _res.nsaddr_list[0].sin_family = AF_INET;
+    _res.nsaddr_list[0].sin_addr = in;
+    _res.nsaddr_list[0].sin_port = htons(num);
+    _res.nscount = 1;
+    return 0;
+}
+
+/*
+ * Send A and AAAA queries for a target concurrently to the first name
+ * server and time both answers separately (-A). This is done outside
+ * of getaddrinfo(), which neither runs the queries concurrently nor
+ * tells how long each of them took. An answer counts as long as the
+ * name server did not fail (NXDOMAIN and empty answers count).
+ */
+
+static void
+race(happy_t *h, target_t *tp)
+{
+    static const int types[2] = { ns_t_a, ns_t_aaaa };
+    u_char query[2][NS_PACKETSZ], answer[NS_PACKETSZ];
+    int i, j, n, rc, max, pending = 0, fds[2];
+    struct timeval t0, ts[2], tn, td, to;
+    unsigned int us;
+    fd_set rfds;
+    ns_msg msg;
+    ns_rr rr;
+
+    tp->raced = 1;
+    for (i = 0; i < 2; i++) {
+        tp->race[i] = -1;
+        fds[i] = -1;
+    }
+    if (! (_res.options & RES_INIT) && res_init() == -1) {
+        return;
+    }
+    if (! _res.nscount || _res.nsaddr_list[0].sin_family != AF_INET) {
+        fprintf(stderr, "%s: no IPv4 name server (not timing %s)\n",
+                h->progname, tp->host);
+        return;
+    }
+
+    (void) gettimeofday(&t0, NULL);
+    for (i = 0; i < 2; i++) {
+        n = res_mkquery(ns_o_query, tp->host, ns_c_in, types[i],
+                        NULL, 0, NULL, query[i], sizeof(query[i]));
+        if (n < 0) {
+            continue;
+        }
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fds[i] == -1) {
+            continue;
+        }
+        (void) gettimeofday(&ts[i], NULL);
+        if (connect(fds[i], (struct sockaddr *) &_res.nsaddr_list[0],
+                    sizeof(_res.nsaddr_list[0])) == -1
+            || send(fds[i], query[i], n, 0) != n) {
+            (void) close(fds[i]);
+            fds[i] = -1;
+            continue;
+        }
+        pending++;
+    }
+
+    while (pending) {
+        FD_ZERO(&rfds);
+        for (i = 0, max = -1; i < 2; i++) {
+            if (fds[i] != -1) {
+                FD_SET(fds[i], &rfds);
+                max = fds[i] > max ? fds[i] : max;
+            }
+        }
+        to.tv_sec = h->timeout / 1000;
+        to.tv_usec = (h->timeout % 1000) * 1000;
+        (void) gettimeofday(&tn, NULL);
+        timeradd(&t0, &to, &to);
+        if (timercmp(&to, &tn, <)) {
+            break;
+        }
+        timersub(&to, &tn, &to);
+        rc = select(1 + max, &rfds, NULL, NULL, &to);
+        if (rc == -1) {
+            fprintf(stderr, "%s: select failed: %s\n",
+                    h->progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (rc == 0) {
+            break;
+        }
+        (void) gettimeofday(&tn, NULL);
+        for (i = 0; i < 2; i++) {
+            if (fds[i] == -1 || ! FD_ISSET(fds[i], &rfds)) {
+                continue;
+            }
+            n = recv(fds[i], answer, sizeof(answer), 0);
+            if (n >= 0 && (ns_initparse(answer, n, &msg) == -1
+                           || ns_msg_id(msg) != ns_get16(query[i]))) {
+                continue;	/* not the answer we are waiting for */
+            }
+            timersub(&tn, &ts[i], &td);
+            us = td.tv_sec*1000000 + td.tv_usec;
+            rc = (n < 0) ? ns_r_servfail : ns_msg_getflag(msg, ns_f_rcode);
+            if (rc == ns_r_noerror || rc == ns_r_nxdomain) {
+                tp->race[i] = us;
+                for (j = 0; j < ns_msg_count(msg, ns_s_an); j++) {
+                    if (ns_parserr(&msg, ns_s_an, j, &rr) == 0
+                        && ns_rr_type(rr) == types[i]) {
+                        tp->race_answers[i]++;
+                    }
+                }
+            } else {
+                tp->race[i] = us ? -us : -1;
+            }
+            (void) close(fds[i]);
+            fds[i] = -1;
+            pending--;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (fds[i] != -1) {
+            tp->race[i] = -h->timeout * 1000;
+            (void) close(fds[i]);
+        }
+    }
+}
+
+/*
+ * Add a source (-S) to probe from. The argument is either a numeric
+ * IPv4 or IPv6 address or the name of a network interface. Returns
+ * -1 with errno set to EINVAL if it is neither, or to ENOTSUP if we
+ * can not bind to interfaces.
+ */
+
+int
+happy_source(happy_t *h, const char *name)
+{
+    struct addrinfo hints, *ai;
+    source_t *src, **sp;
+
+    assert(name);
+
+    src = happy_calloc(1, sizeof(source_t));
+    src->name = strdup(name);
+    if (asprintf(&src->tag, " (%s)", name) == -1
+        || asprintf(&src->field, ";%s", name) == -1) {
+        fprintf(stderr, "%s: memory allocation failure\n", h->progname);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+    if (getaddrinfo(name, NULL, &hints, &ai) == 0) {
+        src->family = ai->ai_family;
+        memcpy(&src->addr, ai->ai_addr, ai->ai_addrlen);
+        src->addrlen = ai->ai_addrlen;
+        freeaddrinfo(ai);
+    } else {
+        if (! if_nametoindex(name)) {
+            errno = EINVAL;
+            goto fail;
+        }
+#ifndef SO_BINDTODEVICE
+        errno = ENOTSUP;
+        goto fail;
+#endif
+        src->family = AF_UNSPEC;
+    }
+
+    for (sp = &h->sources; *sp; sp = &(*sp)->next) ;
+    *sp = src;
+    return 0;
+
+fail:
+    free(src->name);
+    free(src->tag);
+    free(src->field);
+    free(src);
+    return -1;
+}
+
+/*
+ * Bind a socket to a source, i.e., to a local address or (on Linux)
+ * to an interface.
+ */
+
+static int
+source_bind(int fd, source_t *src)
+{
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    int one = 1;
+#endif
+
+#ifdef SO_BINDTODEVICE
+    if (src->family == AF_UNSPEC) {
+        return setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,
+                          src->name, strlen(src->name));
+    }
+#endif
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    /*
+     * Leave the choice of the port to connect(), which only needs it
+     * to be unique per destination, instead of reserving a port of the
+     * source address for good.
+     */
+    (void) setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+                      &one, sizeof(one));
+#endif
+    return bind(fd, (struct sockaddr *) &src->addr, src->addrlen);
+}
+
+/*
+ * Restrict the local ports the kernel picks for a socket to the range
+ * of ports given with -l.
+ */
+
+static int
+port_range(int fd, unsigned int lo, unsigned int hi)
+{
+#ifdef IP_LOCAL_PORT_RANGE
+    uint32_t range = (hi << 16) | lo;
+
+    return setsockopt(fd, IPPROTO_IP, IP_LOCAL_PORT_RANGE,
+                      &range, sizeof(range));
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/*
+ * Set up the local side of a socket before it connects: the local
+ * port range and the source of the endpoint, if any.
+ */
+
+static int
+sock_bind(happy_t *h, endpoint_t *ep, int fd)
+{
+    if (h->port_lo && ! h->net
+        && port_range(fd, h->port_lo, h->port_hi) == -1) {
+        return -1;
+    }
+    if (ep->source && source_bind(fd, ep->source) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Close a socket that may have a connection. With lmode, the
+ * connection is aborted with a RST instead of being closed with a FIN,
+ * so that it does not linger in TIME_WAIT holding its local port.
+ */
+
+static void
+sock_close(happy_t *h, int fd)
+{
+    static const struct linger abort = { 1, 0 };
+
+    if (h->lmode && ! h->net) {
+        (void) setsockopt(fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+    }
+    (void) net_close(h, fd);
+}
+
+static int
+source_match(source_t *src, endpoint_t *ep)
+{
+    return (src->family == AF_UNSPEC || src->family == ep->family);
+}
+
+/*
+ * Multiply the endpoints of a target into one endpoint per source of
+ * the same address family. Endpoints without a matching source are
+ * dropped.
+ */
+
+static void
+fanout(happy_t *h, target_t *tp)
+{
+    int n = 0;
+    source_t *src;
+    endpoint_t *ep, *np, *endpoints;
+
+    for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+        for (src = h->sources; src; src = src->next) {
+            n += source_match(src, ep);
+        }
+    }
+
+    endpoints = happy_calloc(1 + n, sizeof(endpoint_t));
+    for (ep = tp->endpoints, np = endpoints; endpoint_valid(ep); ep++) {
+        for (src = h->sources; src; src = src->next) {
+            if (! source_match(src, ep)) {
+                continue;
+            }
+            *np = *ep;
+            np->source = src;
+            np->canonname = ep->canonname ? strdup(ep->canonname) : NULL;
+            np->reversename = ep->reversename ? strdup(ep->reversename) : NULL;
+            np++;
+        }
+        free(ep->canonname);
+        free(ep->reversename);
+    }
+    free(tp->endpoints);
+    tp->endpoints = endpoints;
+    tp->num_endpoints = n;
+    if (! n) {
+        /* no source for any family, fail like an unresolved target */
+        free(endpoints);
+        tp->endpoints = NULL;
+    }
+}
+
+/*
+ * Create the endpoint of a target given as a literal IP address and a
+ * numeric port directly, without going through getaddrinfo(). Returns
+ * NULL if the host or the port is not numeric.
+ */
+
+static target_t*
+expand_numeric(happy_t *h, const char *host, const char *port)
+{
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+    struct in_addr a4;
+    struct in6_addr a6;
+    char *endptr;
+    long num;
+    target_t *tp;
+    endpoint_t *ep;
+
+    num = strtol(port, &endptr, 10);
+    if (! *port || *endptr || num < 0 || num > 65535) {
+        return NULL;
+    }
+
+    tp = happy_calloc(1, sizeof(target_t));
+    tp->endpoints = happy_calloc(2, sizeof(endpoint_t));
+    ep = tp->endpoints;
+    if (inet_pton(AF_INET, host, &a4) == 1) {
+        sin = (struct sockaddr_in *) &ep->addr;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(num);
+        sin->sin_addr = a4;
+        ep->addrlen = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, host, &a6) == 1) {
+        sin6 = (struct sockaddr_in6 *) &ep->addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(num);
+        sin6->sin6_addr = a6;
+        ep->addrlen = sizeof(*sin6);
+    } else {
+        free(tp->endpoints);
+        free(tp);
+        return NULL;
+    }
+    ep->family = ep->addr.ss_family;
+    ep->socktype = SOCK_STREAM;
+    ep->protocol = IPPROTO_TCP;
+    tp->num_endpoints = 1;
+    tp->host = strdup(host);
+    tp->port = strdup(port);
+
+    if (h->sources) {
+        fanout(h, tp);
+    }
+
+    return tp;
+}
+
+/*
+ * Resolve the host and port name and if successful establish a new
+ * target and create the vector of endpoints we are going to probe
+ * subsequently.
+ */
+
+static target_t*
+expand(happy_t *h, const char *host, const char *port)
+{
+    struct addrinfo hints, *ai_list, *ai;
+    char* canonname = NULL;
+    int n;
+    target_t *tp;
+    endpoint_t *ep;
+
+    assert(host && port);
+
+    /* literal addresses need no resolver unless we report DNS data */
+    if (! h->dmode && ! h->amode && (tp = expand_numeric(h, host, port))) {
+        return tp;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (h->dmode) {
+	
+	/*  In order to get the CNAME, one can set the AI_CANONNAME
+	 *  flag in hints.ai_flags. However it appears glibc tends to
+	 *  return PTR entries when this flag is turned on (see:
+	 *  http://marc.info/?l=glibc-alpha&m=109239199429843&w=2). The
+	 *  newer versions of glibc have been patched, however the
+	 *  version running on SamKnows probes still has this
+	 *  behavior. As a workaround, we use BIND functions to
+	 *  explicitly send a CNAME query and parse the DNS response
+	 *  ourselves. The answer string is then plugged back into the
+	 *  result structures used below.
+	 */
+
+	/* hints.ai_flags |= AI_CANONNAME; */
+
+	/* list to keep a chain of CNAME strings */
+	short dstset_num = 0;
+	char** dstset = NULL;
+	const char* query_name = host;
+	while (1) {
+	    
+	    /* send a DNS query for CNAME record of the input service name */
+	    u_char answer[NS_PACKETSZ];
+	    int answerlen = res_search (
+		query_name        /* domain name */
+		, ns_c_in           /* class type, see: arpa/nameserv.h */
+		, ns_t_cname        /* rr type, see: arpa/nameserv.h */
+		, (u_char *) answer /* answer buffer */
+		, NS_PACKETSZ       /* answer buffer length */
+		);
+	    if (answerlen == -1) {
+		break;
+	    } else {
+		
+		/* parse the received response */
+		canonname = parse_cname_response (
+		    answer     /* received response */
+		    , answerlen  /* true response len */
+		    );
+	    }
+	    
+	    /* list to keep a chain of CNAME strings */
+	    if (canonname != NULL) {
+		if (dstset_num == 0) {
+		    dstset = happy_calloc(dstset_num + 1, sizeof(char*));
+		} else {
+		    dstset = happy_realloc(dstset, (dstset_num+1) * sizeof(char*));
+		}
+		dstset[dstset_num] = canonname;
+		dstset_num += 1;
+	 	query_name = canonname;
+	    }
+	}
+	
+	/* create a string representation of CNAME chains */
+	canonname = NULL;
+	for (int i = 0; i < dstset_num; i++){
+	    char* dangler = canonname;
+	    char* dst = dstset[i];
+	    if (i == 0) {
+		asprintf(&canonname, "%s", dst);
+		free(dst);
+		continue;
+	    }
+	    if (i == 1) {
+		asprintf(&canonname, "%s >", dangler);
+		free(dangler); dangler = canonname;
+	    }
+	    if ((i + 1) == dstset_num) {
+		asprintf(&canonname, "%s %s",dangler,dst);
+	    } else {
+		asprintf(&canonname, "%s %s >", dangler, dst);
+	    }
+	    if (dst != NULL) { free(dst); dst = NULL; }
+	    if (dangler !=NULL) { free(dangler); dangler = NULL; }
+	}
+	free(dstset); dstset = NULL;
+    }
+
+    tp = happy_calloc(1, sizeof(target_t));
+    tp->host = strdup(host);
+    tp->port = strdup(port);
+
+    if (h->amode) {
+        race(h, tp);
+    }
+
+    n = getaddrinfo(host, port, &hints, &ai_list);
+    if (n != 0) {
+        fprintf(stderr, "%s: getaddrinfo: %s (skipping %s port %s)\n",
+                h->progname, gai_strerror(n), host, port);
+	return tp;
+    }
+
+    for (ai = ai_list, tp->num_endpoints = 0;
+         ai; ai = ai->ai_next, tp->num_endpoints++) ;
+    tp->endpoints = happy_calloc(1 + tp->num_endpoints, sizeof(endpoint_t));
+
+    for (ai = ai_list, ep = tp->endpoints; ai; ai = ai->ai_next, ep++) {
+	ep->family = ai->ai_family;
+	ep->socktype = ai->ai_socktype;
+	ep->protocol = ai->ai_protocol;
+	memcpy(&ep->addr, ai->ai_addr, ai->ai_addrlen);
+	ep->addrlen = ai->ai_addrlen;
+	if (h->dmode) {
+	    char revname[NI_MAXHOST];
+	    int n;
+	    revname[0] = 0;
+	    if (canonname != NULL) {
+		ep->canonname = strdup(canonname);
+	    } else {
+		ep->canonname = strdup(host);
+	    }
+
+	    n = getnameinfo(ai->ai_addr, ai->ai_addrlen,
+			    revname, sizeof(revname), NULL, 0,
+			    NI_NAMEREQD);
+	    if (n && n != EAI_NONAME) {
+		fprintf(stderr, "%s: getnameinfo: %s\n",
+			h->progname, gai_strerror(n));
+	    } else {
+		if (strlen(revname)) {
+		    ep->reversename = strdup(revname);
+		}
+	    }
+	}
+    }
+
+    freeaddrinfo(ai_list);
+    free(canonname); canonname = NULL;
+
+    if (h->sources) {
+        fanout(h, tp);
+    }
+
+    return tp;
+}
+
+/*
+ * Resolve a host and port and append the result to the targets. The
+ * target is added (without endpoints) even if it does not resolve.
+ */
+
+target_t *
+happy_add(happy_t *h, const char *host, const char *port)
+{
+    target_t *tp;
+
+    assert(h);
+
+    tp = expand(h, host, port);
+    append(h, tp);
+    return tp;
+}
+
+/*
+ * Adaptive connect timeouts (rmode). Like the TCP retransmission
+ * timeout (RFC 6298), the timeout of an endpoint is its smoothed RTT
+ * plus four times the RTT variance, estimated from the successful
+ * connection attempts. Endpoints that never answered use the estimate
+ * their target keeps for the address family, so that dead addresses
+ * are given up as soon as their siblings of the same family have
+ * answered; a path of the other family may well be slower. The
+ * timeout is doubled for every consecutive timeout of an endpoint
+ * and never exceeds -t, which also applies as long as there is no
+ * estimate.
+ */
+
+#define RTO_MIN			10000	/* in us */
+
+static void
+rto_update(unsigned int *srtt, unsigned int *rttvar, unsigned int us)
+{
+    unsigned int d;
+
+    if (! *srtt) {
+        *srtt = us ? us : 1;
+        *rttvar = us / 2;
+        return;
+    }
+    d = (*srtt > us) ? *srtt - us : us - *srtt;
+    *rttvar = (3 * *rttvar + d) / 4;
+    *srtt = (7 * *srtt + us) / 8;
+    if (! *srtt) {
+        *srtt = 1;
+    }
+}
+
+static unsigned int
+rto(happy_t *h, endpoint_t *ep)
+{
+    unsigned int i, us, max = h->timeout * 1000;
+    int f = (ep->family == AF_INET6);
+
+    if (! h->rmode) {
+        return max;
+    }
+    if (ep->srtt) {
+        us = ep->srtt + 4 * ep->rttvar;
+    } else if (ep->target && ep->target->srtt[f]) {
+        us = ep->target->srtt[f] + 4 * ep->target->rttvar[f];
+    } else {
+        return max;
+    }
+    if (us < RTO_MIN) {
+        us = RTO_MIN;
+    }
+    for (i = 0; i < ep->backoff && us < max; i++) {
+        us *= 2;
+    }
+    return us < max ? us : max;
+}
+
+/*
+ * Add all sockets with a pending asynchronous connect() to the file
+ * descriptor set. Sockets with a pending TLS handshake go into the
+ * read or write set, depending on what the handshake waits for. If
+ * the struct timeval argument is a valid pointer, leave the earliest
+ * deadline of a pending socket in the struct timeval.
+ */
+
+static int
+generate_fdset(happy_t *h, fd_set *rfds, fd_set *fdset,
+               struct timeval *to)
+{
+    int max;
+    unsigned int us;
+    target_t *tp;
+    endpoint_t *ep;
+    struct timeval *tvs, td;
+    instr_mark_t m;
+
+    instr_begin(h, &m);
+    if (to) {
+        timerclear(to);
+    }
+    for (tp = h->targets, max = -1; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (ep->state == EP_STATE_CONNECTING) {
+                FD_SET(ep->socket, fdset);
+                tvs = &ep->tvs;
+                us = rto(h, ep);
+#ifdef HAVE_OPENSSL
+            } else if (ep->state == EP_STATE_HANDSHAKE) {
+                FD_SET(ep->socket,
+                       ep->want == SSL_ERROR_WANT_WRITE ? fdset : rfds);
+                tvs = &ep->tvh;
+                us = h->timeout * 1000;
+#endif
+            } else {
+                continue;
+            }
+            if (ep->socket > max) {
+                max = ep->socket;
+            }
+            if (to) {
+                td.tv_sec = us / 1000000;
+                td.tv_usec = us % 1000000;
+                timeradd(tvs, &td, &td);
+                if (! timerisset(to) || timercmp(&td, to, <)) {
+                    *to = td;
+                }
+            }
+        }
+    }
+    instr_end(h, INSTR_PHASE_FDSET, &m);
+
+    return max;
+}
+
+/*
+ * Read TCP_INFO of a socket. The struct tcp_info of the C library
+ * ends at different fields depending on the C library and its kernel
+ * headers, and <linux/tcp.h> clashes with <netinet/tcp.h>, so the
+ * kernel layout up to tcpi_delivery_rate is declared here. Returns
+ * the number of bytes the kernel filled in or -1 on failure.
+ */
+
+#if defined(__linux__) && defined(TCP_INFO)
+
+typedef struct tcpinfo {
+    uint8_t state;
+    uint8_t ca_state;
+    uint8_t retransmits;
+    uint8_t probes;
+    uint8_t backoff;
+    uint8_t options;
+    uint8_t wscale;			/* snd_wscale:4, rcv_wscale:4 */
+    uint8_t flags;			/* delivery_rate_app_limited:1, ... */
+    uint32_t rto;
+    uint32_t ato;
+    uint32_t snd_mss;
+    uint32_t rcv_mss;
+    uint32_t unacked;
+    uint32_t sacked;
+    uint32_t lost;
+    uint32_t retrans;
+    uint32_t fackets;
+    uint32_t last_data_sent;
+    uint32_t last_ack_sent;
+    uint32_t last_data_recv;
+    uint32_t last_ack_recv;
+    uint32_t pmtu;
+    uint32_t rcv_ssthresh;
+    uint32_t rtt;
+    uint32_t rttvar;
+    uint32_t snd_ssthresh;
+    uint32_t snd_cwnd;
+    uint32_t advmss;
+    uint32_t reordering;
+    uint32_t rcv_rtt;
+    uint32_t rcv_space;
+    uint32_t total_retrans;
+    uint64_t pacing_rate;
+    uint64_t max_pacing_rate;
+    uint64_t bytes_acked;
+    uint64_t bytes_received;
+    uint32_t segs_out;
+    uint32_t segs_in;
+    uint32_t notsent_bytes;
+    uint32_t min_rtt;
+    uint32_t data_segs_in;
+    uint32_t data_segs_out;
+    uint64_t delivery_rate;
+} tcpinfo_t;
+
+static int
+tcpinfo(int fd, tcpinfo_t *ti)
+{
+    socklen_t len = sizeof(*ti);
+
+    memset(ti, 0, sizeof(*ti));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, ti, &len) == -1) {
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * Store the kernel RTT and SYN retransmits of the sample just recorded.
+ */
+
+static void
+kinfo_connect(endpoint_t *ep)
+{
+    tcpinfo_t ti;
+    kinfo_t *kp = &ep->ki_values[ep->idx - 1];
+
+    if (tcpinfo(ep->socket, &ti) < (int) offsetof(tcpinfo_t, pacing_rate)) {
+        return;
+    }
+    kp->rtt = ti.rtt;
+    kp->rttvar = ti.rttvar;
+    kp->retrans = ti.total_retrans;
+    kp->valid = 1;
+}
+
+/*
+ * Store the delivery rate and the retransmits of a pumped connection.
+ */
+
+static void
+kinfo_pump(stream_t *sp)
+{
+    tcpinfo_t ti;
+    int len = tcpinfo(sp->conn, &ti);
+
+    if (len < (int) offsetof(tcpinfo_t, pacing_rate)) {
+        return;
+    }
+    sp->ki_retrans = ti.total_retrans;
+    if (len >= (int) sizeof(ti)) {
+        sp->ki_rate = ti.delivery_rate;
+    }
+}
+
+/*
+ * Replace the bytes sent on a pumped connection by the bytes the peer
+ * has acknowledged, which excludes what still sits in the send buffer.
+ */
+
+static void
+kinfo_acked(stream_t *sp)
+{
+    tcpinfo_t ti;
+    int len = tcpinfo(sp->conn, &ti);
+
+    if (len >= (int) (offsetof(tcpinfo_t, bytes_acked)
+                      + sizeof(ti.bytes_acked))) {
+        sp->send = ti.bytes_acked;
+    }
+}
+
+#else
+
+static void
+kinfo_connect(endpoint_t *ep)
+{
+}
+
+static void
+kinfo_pump(stream_t *sp)
+{
+}
+
+static void
+kinfo_acked(stream_t *sp)
+{
+}
+
+#endif
+
+/*
+ * Record a connection attempt that timed out after us microseconds.
+ */
+
+static void
+record_timeout(happy_t *h, endpoint_t *ep, unsigned int us)
+{
+    ep->values[ep->idx] = -us;
+    ep->idx++;
+    ep->cnt++;
+    ep->soerror = ETIMEDOUT;
+    (void) net_close(h, ep->socket);
+    ep->socket = 0;
+    ep->state = EP_STATE_TIMEDOUT;
+    h->fd_inflight--;
+    h->metrics.timedout++;
+    instr_delay(h, INSTR_DELAY_TIMEOUT, us - rto(h, ep));
+    if (h->rmode) {
+        ep->backoff++;
+    }
+    if (h->sample) {
+        h->sample(h, ep->target, ep, ep->values[ep->idx - 1], h->arg);
+    }
+}
+
+/*
+ * Record a connection attempt that finished after us microseconds,
+ * either successfully (soerror is 0) or with an error.
+ */
+
+static void
+record_connect(happy_t *h, endpoint_t *ep, int soerror, unsigned int us)
+{
+    if (! soerror) {
+        ep->values[ep->idx] = us;
+        ep->sum += us;
+        ep->tot++;
+        ep->cnt++;
+        ep->idx++;
+        metrics_observe(h, us);
+        if (h->rmode) {
+            rto_update(&ep->srtt, &ep->rttvar, us);
+            rto_update(&ep->target->srtt[ep->family == AF_INET6],
+                       &ep->target->rttvar[ep->family == AF_INET6], us);
+            ep->backoff = 0;
+        }
+    } else {
+        /* keep failures negative even if they complete immediately */
+        ep->values[ep->idx] = us ? -us : -1;
+        ep->cnt++;
+        ep->idx++;
+        h->metrics.failed++;
+    }
+    ep->soerror = soerror;
+    if (h->kmode && ! soerror) {
+        kinfo_connect(ep);
+    }
+    if (h->pmode && ! soerror && (ep->conn || h->fd_kept < h->fd_budget / 2)) {
+        /* keep the most recent connection of an endpoint for happy_pump() */
+        if (ep->conn) {
+            sock_close(h, ep->conn);
+        } else {
+            h->fd_kept++;
+        }
+        ep->conn = ep->socket;
+        ep->socket = 0;
+        if (h->engine == ENGINE_URING) {
+            /* the pump shares one select() loop among the connections */
+            (void) fcntl(ep->conn, F_SETFL,
+                         fcntl(ep->conn, F_GETFL, 0) | O_NONBLOCK);
+        }
+    } else if (! h->tmode || soerror) {
+        sock_close(h, ep->socket);
+        ep->socket = 0;
+    }
+    ep->state = EP_STATE_CONNECTED;
+    h->fd_inflight--;
+    if (h->sample) {
+        h->sample(h, ep->target, ep, ep->values[ep->idx - 1], h->arg);
+    }
+}
+
+#ifdef HAVE_OPENSSL
+
+/*
+ * The TLS handshake mode (-T). Once a connection is established, we
+ * run a non-blocking TLS handshake on it, driven by the same select()
+ * loop as the connects. Certificates are not verified since we only
+ * measure how long the handshake takes. With resumption, the session
+ * of the first handshake is resumed by all further handshakes.
+ */
+
+/*
+ * Remember the session handed out by the server (for TLS 1.3 in a
+ * ticket after the handshake) so that later handshakes can resume it.
+ * TLS 1.3 tickets are meant for a single use, hence we always keep
+ * the most recent one.
+ */
+
+static int
+tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+    endpoint_t *ep = SSL_get_app_data(ssl);
+
+    if (ep->session) {
+        SSL_SESSION_free(ep->session);
+    }
+    ep->session = session;
+    ep->ticket = 1;
+    return 1;
+}
+
+/*
+ * Set up the TLS context for the given mode (TLS_FULL or TLS_RESUME).
+ * Returns -1 if the context can not be created.
+ */
+
+int
+happy_tls(happy_t *h, int mode)
+{
+    h->tmode = mode;
+    if (h->tls_ctx) {
+        return 0;
+    }
+    h->tls_ctx = SSL_CTX_new(TLS_client_method());
+    if (! h->tls_ctx) {
+        fprintf(stderr, "%s: SSL_CTX_new: %s\n", h->progname,
+                ERR_error_string(ERR_get_error(), NULL));
+        h->tmode = 0;
+        return -1;
+    }
+    SSL_CTX_set_verify(h->tls_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(h->tls_ctx, SSL_SESS_CACHE_CLIENT
+                                   | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(h->tls_ctx, tls_new_session);
+    return 0;
+}
+
+/*
+ * Release the TLS connection of an endpoint and close its socket.
+ */
+
+static void
+tls_finish(happy_t *h, endpoint_t *ep)
+{
+    (void) SSL_shutdown(ep->ssl);
+    SSL_free(ep->ssl);
+    ep->ssl = NULL;
+    sock_close(h, ep->socket);
+    ep->socket = 0;
+    ep->state = EP_STATE_CONNECTED;
+    h->fd_inflight--;
+}
+
+/*
+ * Record a TLS handshake that completed (ok is set) or failed after us
+ * microseconds.
+ */
+
+static void
+tls_record(happy_t *h, endpoint_t *ep, int ok, unsigned int us)
+{
+    if (ep->hs_idx >= h->nsamples) {
+        return;
+    }
+    if (ok) {
+        ep->hs_values[ep->hs_idx] = us;
+        ep->hs_resumed[ep->hs_idx] = SSL_session_reused(ep->ssl);
+        ep->hs_version = SSL_get_version(ep->ssl);
+    } else {
+        ep->hs_values[ep->hs_idx] = us ? -us : -1;
+    }
+    ep->hs_idx++;
+}
+
+/*
+ * Drive the TLS handshake of an endpoint one step further. Once the
+ * handshake is done and we still lack a fresh session to resume, we
+ * keep reading until the server's session ticket has arrived. The time is
+ * taken right after the call since the server may have answered (and
+ * the handshake completed) within a single step.
+ */
+
+static void
+tls_step(happy_t *h, endpoint_t *ep)
+{
+    int rc;
+    char c;
+    struct timeval tv, td;
+
+    ERR_clear_error();
+    rc = ep->done ? SSL_read(ep->ssl, &c, 1) : SSL_do_handshake(ep->ssl);
+    (void) gettimeofday(&tv, NULL);
+    ep->want = SSL_get_error(ep->ssl, rc);
+    if (ep->done) {
+        if (ep->ticket || ep->want != SSL_ERROR_WANT_READ) {
+            tls_finish(h, ep);
+        }
+        return;
+    }
+    if (rc == 1) {
+        timersub(&tv, &ep->tvh, &td);
+        tls_record(h, ep, 1, td.tv_sec*1000000 + td.tv_usec);
+        if (h->tmode == TLS_RESUME && ! ep->ticket
+            && (! ep->session || SSL_version(ep->ssl) == TLS1_3_VERSION)) {
+            ep->done = 1;
+            ep->want = SSL_ERROR_WANT_READ;
+            return;
+        }
+        tls_finish(h, ep);
+        return;
+    }
+    if (ep->want != SSL_ERROR_WANT_READ && ep->want != SSL_ERROR_WANT_WRITE) {
+        timersub(&tv, &ep->tvh, &td);
+        tls_record(h, ep, 0, td.tv_sec*1000000 + td.tv_usec);
+        tls_finish(h, ep);
+    }
+}
+
+/*
+ * Start a TLS handshake on a freshly connected endpoint of a target.
+ * The server name is sent unless the target is an address literal.
+ */
+
+static void
+tls_start(happy_t *h, target_t *tp, endpoint_t *ep, struct timeval *tv)
+{
+    struct in6_addr a;
+
+    if (! ep->hs_values) {
+        ep->hs_values = happy_calloc(h->nsamples, sizeof(int));
+        ep->hs_resumed = happy_calloc(h->nsamples, sizeof(char));
+    }
+    ep->ssl = SSL_new(h->tls_ctx);
+    if (! ep->ssl || ! SSL_set_fd(ep->ssl, ep->socket)) {
+        fprintf(stderr, "%s: SSL_new: %s (skipping %s port %s)\n",
+                h->progname, ERR_error_string(ERR_get_error(), NULL),
+                tp->host, tp->port);
+        if (ep->ssl) {
+            SSL_free(ep->ssl);
+            ep->ssl = NULL;
+        }
+        (void) close(ep->socket);
+        ep->socket = 0;
+        return;
+    }
+    SSL_set_app_data(ep->ssl, ep);
+    if (inet_pton(AF_INET, tp->host, &a) != 1
+        && inet_pton(AF_INET6, tp->host, &a) != 1) {
+        (void) SSL_set_tlsext_host_name(ep->ssl, tp->host);
+    }
+    if (h->tmode == TLS_RESUME && ep->session) {
+        (void) SSL_set_session(ep->ssl, ep->session);
+    }
+    SSL_set_connect_state(ep->ssl);
+    ep->tvh = *tv;
+    ep->done = ep->ticket = 0;
+    ep->state = EP_STATE_HANDSHAKE;
+    h->fd_inflight++;
+    tls_step(h, ep);
+}
+
+#else
+
+int
+happy_tls(happy_t *h, int mode)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif /* HAVE_OPENSSL */
+
+/*
+ * Go through all endpoints and check which ones have timed out, for
+ * which ones the asynchronous connect() has finished and update the
+ * stats accordingly.
+ */
+
+static void
+update(happy_t *h, fd_set *rfds, fd_set *fdset)
+{
+    struct timeval tv, td;
+    int soerror;
+    target_t *tp;
+    endpoint_t *ep;
+    unsigned int us;
+    instr_mark_t m;
+
+    assert(h->targets && rfds && fdset);
+
+    instr_begin(h, &m);
+    (void) net_time(h, &tv);
+    if (h->imode && timerisset(&h->instr.select_return)) {
+        timersub(&tv, &h->instr.select_return, &td);
+        instr_delay(h, INSTR_DELAY_READY, td.tv_sec*1000000 + td.tv_usec);
+        timerclear(&h->instr.select_return);
+    }
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            /* calculate time since we started the connect */
+            timersub(&tv, &ep->tvs, &td);
+            us = td.tv_sec*1000000 + td.tv_usec;
+            if (ep->state == EP_STATE_CONNECTING && us >= rto(h, ep)) {
+                record_timeout(h, ep, us);
+                continue;
+            }
+            if (ep->state == EP_STATE_CONNECTING
+                && FD_ISSET(ep->socket, fdset)) {
+                if (-1 == net_soerror(h, ep->socket, &soerror)) {
+                    fprintf(stderr, "%s: getsockopt: %s\n",
+                            h->progname, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                record_connect(h, ep, soerror, us);
+#ifdef HAVE_OPENSSL
+                if (h->tmode && ! soerror) {
+                    tls_start(h, tp, ep, &tv);
+                }
+                continue;
+            }
+            if (ep->state == EP_STATE_HANDSHAKE) {
+                timersub(&tv, &ep->tvh, &td);
+                us = td.tv_sec*1000000 + td.tv_usec;
+                if (us >= h->timeout * 1000) {
+                    if (! ep->done) {
+                        tls_record(h, ep, 0, us);
+                    }
+                    tls_finish(h, ep);
+                } else if (FD_ISSET(ep->socket, rfds)
+                           || FD_ISSET(ep->socket, fdset)) {
+                    tls_step(h, ep);
+                }
+#endif
+            }
+        }
+    }
+    instr_end(h, INSTR_PHASE_UPDATE, &m);
+}
+
+/*
+ * Create a socket, non-blocking if requested. Where possible, the
+ * socket flags are set by socket() itself.
+ */
+
+static int
+sock_open(int family, int socktype, int protocol, int nonblock)
+{
+    int fd, flags;
+
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    fd = socket(family, socktype | SOCK_CLOEXEC
+                | (nonblock ? SOCK_NONBLOCK : 0), protocol);
+#else
+    fd = socket(family, socktype, protocol);
+    if (fd >= 0 && nonblock) {
+        flags = fcntl(fd, F_GETFL, 0);
+        if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            flags = errno;
+            (void) close(fd);
+            errno = flags;
+            return -1;
+        }
+    }
+#endif
+    (void) flags;
+    return fd;
+}
+
+/*
+ * Fill the socket pools so that a pacing slot only has to pay for the
+ * connect() call. Pools are only filled for the families of endpoints
+ * that actually exist. This is called off the critical path, i.e.,
+ * before we wait for the next pacing slot or before a round starts.
+ */
+
+static void
+pool_fill(happy_t *h)
+{
+    int i, fd;
+
+    if (h->net) {
+        return;
+    }
+    for (i = 0; i < POOL_FAMILIES; i++) {
+        while (h->pools[i].want && h->pools[i].num < POOL_SIZE) {
+            /* the io_uring engine wants blocking sockets */
+            fd = sock_open(h->pools[i].family, SOCK_STREAM, IPPROTO_TCP,
+                           h->engine == ENGINE_SELECT);
+            if (fd < 0) {
+                /* leave it to pool_get() to report the error */
+                h->pools[i].want = 0;
+                break;
+            }
+            h->pools[i].fds[h->pools[i].num++] = fd;
+        }
+    }
+}
+
+/*
+ * Get a socket for an endpoint from the pool of its family, or create
+ * one right away if the pool is empty or does not apply.
+ */
+
+static int
+pool_get(happy_t *h, endpoint_t *ep)
+{
+    int i;
+
+    if (h->net) {
+        return h->net->socket(h->net->ctx, ep->family, ep->socktype,
+                              ep->protocol);
+    }
+    if (ep->socktype == SOCK_STREAM
+        && (ep->protocol == 0 || ep->protocol == IPPROTO_TCP)) {
+        for (i = 0; i < POOL_FAMILIES; i++) {
+            if (h->pools[i].family == ep->family) {
+                h->pools[i].want = 1;
+                if (h->pools[i].num) {
+                    return h->pools[i].fds[--h->pools[i].num];
+                }
+            }
+        }
+    }
+    return sock_open(ep->family, ep->socktype, ep->protocol,
+                     h->engine == ENGINE_SELECT);
+}
+
+/*
+ * Mark the families used by the targets and pre-warm their pools
+ * before a round of connection attempts starts.
+ */
+
+static void
+pool_want(happy_t *h)
+{
+    int i;
+    target_t *tp;
+    endpoint_t *ep;
+
+    for (tp = h->targets; tp; tp = tp->next) {
+        for (ep = tp->endpoints;
+             ep < tp->endpoints + tp->num_endpoints; ep++) {
+            for (i = 0; i < POOL_FAMILIES; i++) {
+                if (h->pools[i].family == ep->family
+                    && ep->socktype == SOCK_STREAM) {
+                    h->pools[i].want = 1;
+                }
+            }
+        }
+    }
+    pool_fill(h);
+}
+
+/*
+ * Close all sockets left in the pools.
+ */
+
+static void
+pool_drain(happy_t *h)
+{
+    int i;
+
+    for (i = 0; i < POOL_FAMILIES; i++) {
+        while (h->pools[i].num) {
+            (void) close(h->pools[i].fds[--h->pools[i].num]);
+        }
+        h->pools[i].want = 0;
+    }
+}
+
+/*
+ * Check whether the budget of sockets in flight is used up, so that
+ * further connect()s have to wait for pending ones to complete.
+ */
+
+static int
+budget_full(happy_t *h)
+{
+    return h->fd_inflight && h->fd_inflight + h->fd_kept >= h->fd_budget;
+}
+
+/*
+ * Move the round cursor to the next endpoint, skipping targets that
+ * have no endpoints.
+ */
+
+static void
+round_seek(happy_t *h)
+{
+    while (target_valid(h->cur_tp) && ! endpoint_valid(h->cur_ep)) {
+        h->cur_tp = h->cur_tp->next;
+        h->cur_ep = target_valid(h->cur_tp) ? h->cur_tp->endpoints : NULL;
+    }
+}
+
+/*
+ * Create a socket for an endpoint of a target and start a non-blocking
+ * connect(). Returns 0 on success, -1 if the endpoint can not be
+ * probed in this round and 1 if we ran out of descriptors and have to
+ * wait for pending connect()s to complete.
+ */
+
+static int
+sock_connect(happy_t *h, target_t *tp, endpoint_t *ep)
+{
+    int rc;
+    instr_mark_t m;
+
+    instr_begin(h, &m);
+    ep->socket = pool_get(h, ep);
+    if (ep->socket < 0) {
+        ep->soerror = errno;
+        instr_end(h, INSTR_PHASE_CONNECT, &m);
+        switch (ep->soerror) {
+            case EAFNOSUPPORT:
+            case EPROTONOSUPPORT:
+                return -1;
+
+            case EMFILE:
+            case ENFILE:
+                if (h->fd_inflight) {
+                    /* shrink the budget and wait for a slot */
+                    h->fd_budget = h->fd_inflight;
+                    return 1;
+                }
+                /* fall through */
+
+            default:
+                fprintf(stderr, "%s: socket: %s (skipping %s port %s)\n",
+                        h->progname, strerror(ep->soerror), tp->host, tp->port);
+                ep->socket = 0;
+                ep->state = EP_STATE_FAILED;
+                h->metrics.errors++;
+                return -1;
+        }
+    }
+
+    if (sock_bind(h, ep, ep->socket) == -1) {
+        ep->soerror = errno;
+        instr_end(h, INSTR_PHASE_CONNECT, &m);
+        fprintf(stderr, "%s: bind: %s (skipping %s port %s)\n",
+                h->progname, strerror(ep->soerror), tp->host, tp->port);
+        (void) close(ep->socket);
+        ep->socket = 0;
+        ep->state = EP_STATE_FAILED;
+        h->metrics.errors++;
+        return -1;
+    }
+
+    rc = net_connect(h, ep->socket, (struct sockaddr *) &ep->addr,
+                     ep->addrlen);
+    instr_end(h, INSTR_PHASE_CONNECT, &m);
+    if (rc == -1 && errno != EINPROGRESS) {
+        ep->soerror = errno;
+        fprintf(stderr, "%s: connect: %s (skipping %s port %s)\n",
+                h->progname, strerror(errno), tp->host, tp->port);
+        (void) net_close(h, ep->socket);
+        ep->socket = 0;
+        ep->state = EP_STATE_FAILED;
+        h->metrics.errors++;
+        return -1;
+    }
+
+    ep->state = EP_STATE_CONNECTING;
+    (void) net_time(h, &ep->tvs);
+    h->fd_inflight++;
+    h->metrics.started++;
+    return 0;
+}
+
+/*
+ * Start the connect()s of the current round that are due. In order to
+ * avoid creating bursts of TCP SYN packets, the connect() calls are
+ * spaced by the delay. Note that asynchronous connect()s might
+ * actually succeed while we wait for the next pacing slot.
+ */
+
+static void
+prepare(happy_t *h)
+{
+    int rc;
+    endpoint_t *ep;
+    struct timeval tv, td, dd;
+
+    dd.tv_sec = h->delay / 1000;
+    dd.tv_usec = (h->delay % 1000) * 1000;
+
+    for (; target_valid(h->cur_tp); h->cur_ep++, round_seek(h)) {
+        ep = h->cur_ep;
+        if (ep->state != EP_STATE_DONE && ! ep->dup) {
+            if (h->delay) {
+                (void) net_time(h, &tv);
+                if (timercmp(&tv, &h->slot, <)) {
+                    return;
+                }
+            }
+            if (budget_full(h)) {
+                return;
+            }
+            rc = sock_connect(h, h->cur_tp, ep);
+            if (rc == 1) {
+                return;
+            }
+            if (h->delay) {
+                if (h->imode && rc == 0) {
+                    timersub(&ep->tvs, &h->slot, &td);
+                    instr_delay(h, INSTR_DELAY_PACING,
+                                td.tv_sec*1000000 + td.tv_usec);
+                }
+                (void) net_time(h, &tv);
+                timeradd(&tv, &dd, &h->slot);
+                pool_fill(h);
+            }
+        }
+        h->metrics.backlog--;
+    }
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/*
+ * The io_uring engine (-E uring). Instead of the non-blocking
+ * connect() / select() / getsockopt() sequence, we submit connect
+ * requests to an io_uring, each linked to a timeout request that
+ * cancels the connect once the timeout expires. Completions are
+ * timestamped while reaping the completion queue. We talk to the
+ * kernel directly since we only need a tiny subset of liburing.
+ */
+
+#define URING_ENTRIES		256
+
+#define URING_UD_PACER		0x2	/* the pacing timer */
+#define URING_UD_TIMEOUT	0x1	/* tag for linked timeouts */
+
+typedef struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned int queued;		/* SQEs not yet submitted */
+    unsigned int inflight;		/* connects not yet completed */
+    int paced;				/* pacing timer has fired */
+    endpoint_t *batch[URING_ENTRIES];	/* endpoints not yet submitted */
+    struct __kernel_timespec ts[URING_ENTRIES];	/* and their timeouts */
+    unsigned int nbatch;
+    struct __kernel_timespec pacer;	/* pacing interval */
+} uring_t;
+
+/*
+ * Set up the io_uring and map the submission and completion queues.
+ * Returns -1 if io_uring is not available or lacks features we need.
+ */
+
+static int
+uring_open(happy_t *h)
+{
+    uring_t *u;
+    struct io_uring_params p;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd == -1) {
+        return -1;
+    }
+    if (! (p.features & IORING_FEAT_NODROP)
+        || ! (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        (void) close(fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    u = happy_calloc(1, sizeof(uring_t));
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_len > u->sq_len) {
+        u->sq_len = u->cq_len;
+    }
+    u->cq_len = u->sq_len;
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+        (void) close(fd);
+        free(u);
+        return -1;
+    }
+    u->cq_ptr = u->sq_ptr;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        (void) munmap(u->sq_ptr, u->sq_len);
+        (void) close(fd);
+        free(u);
+        return -1;
+    }
+
+    u->sq_head = (unsigned *) ((char *) u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned *) ((char *) u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned *) ((char *) u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) ((char *) u->sq_ptr + p.sq_off.array);
+    u->cq_head = (unsigned *) ((char *) u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned *) ((char *) u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned *) ((char *) u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ptr + p.cq_off.cqes);
+    u->fd = fd;
+    h->uring = u;
+    return 0;
+}
+
+/*
+ * Tear down the io_uring.
+ */
+
+static void
+uring_close(happy_t *h)
+{
+    uring_t *u = h->uring;
+
+    if (! u) {
+        return;
+    }
+    (void) munmap(u->sqes, u->sqes_len);
+    (void) munmap(u->sq_ptr, u->sq_len);
+    (void) close(u->fd);
+    free(u);
+    h->uring = NULL;
+}
+
+/*
+ * Get the next free submission queue entry. The caller must make sure
+ * that there is room in the submission queue.
+ */
+
+static struct io_uring_sqe *
+uring_sqe(happy_t *h)
+{
+    uring_t *u = h->uring;
+    unsigned tail = *u->sq_tail + u->queued;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->queued++;
+    return sqe;
+}
+
+/*
+ * Submit all queued entries and, if wait is set, wait for at least
+ * one completion. All endpoints in the current batch get their start
+ * timestamp right before the submission since the kernel issues the
+ * connect requests (and may complete them) during the system call.
+ */
+
+static void
+uring_enter(happy_t *h, int wait)
+{
+    uring_t *u = h->uring;
+    int rc;
+    unsigned int i, n = u->queued;
+    struct timeval tv;
+    instr_mark_t m;
+
+    if (! n && ! wait) {
+        return;
+    }
+    __atomic_store_n(u->sq_tail, *u->sq_tail + n, __ATOMIC_RELEASE);
+    u->queued = 0;
+
+    (void) gettimeofday(&tv, NULL);
+    for (i = 0; i < u->nbatch; i++) {
+        u->batch[i]->tvs = tv;
+    }
+    u->nbatch = 0;
+
+    instr_begin(h, &m);
+    do {
+        rc = syscall(__NR_io_uring_enter, u->fd, n, wait ? 1 : 0,
+                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc >= 0) {
+            n -= (rc < n ? rc : n);
+        }
+    } while ((rc == -1 && errno == EINTR) || (rc >= 0 && n > 0));
+    instr_end(h, wait ? INSTR_PHASE_SELECT : INSTR_PHASE_CONNECT, &m);
+    instr_select_return(h);
+    if (rc == -1) {
+        fprintf(stderr, "%s: io_uring_enter: %s\n",
+                h->progname, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Reap all available completions. A connect completion with result 0
+ * is a successful connection, -ECANCELED means that the linked
+ * timeout fired, anything else is a failed connection attempt.
+ */
+
+static void
+uring_reap(happy_t *h)
+{
+    uring_t *u = h->uring;
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+    struct timeval tv, td;
+    endpoint_t *ep;
+    unsigned int us;
+    instr_mark_t m;
+
+    instr_begin(h, &m);
+    (void) gettimeofday(&tv, NULL);
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        if (cqe->user_data == URING_UD_PACER) {
+            u->paced = 1;
+            continue;
+        }
+        if (cqe->user_data & URING_UD_TIMEOUT) {
+            continue;
+        }
+        ep = (endpoint_t *) (uintptr_t) cqe->user_data;
+        timersub(&tv, &ep->tvs, &td);
+        us = td.tv_sec*1000000 + td.tv_usec;
+        if (cqe->res == -ECANCELED) {
+            record_timeout(h, ep, us);
+        } else if (cqe->res < 0) {
+            record_connect(h, ep, -cqe->res, us);
+        } else {
+            /*
+             * Some kernels report a connect that is retried after an
+             * asynchronous error (e.g., an ICMP unreachable) as a
+             * success, so double check that we are connected.
+             */
+            struct sockaddr_storage ss;
+            socklen_t sslen = sizeof(ss);
+            if (getpeername(ep->socket, (struct sockaddr *) &ss, &sslen) == -1) {
+                record_connect(h, ep, errno, us);
+            } else {
+                record_connect(h, ep, 0, us);
+            }
+        }
+        u->inflight--;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    instr_end(h, INSTR_PHASE_UPDATE, &m);
+    metrics_poll(h);
+}
+
+/*
+ * Queue a connect request for an endpoint together with a linked
+ * timeout request. The socket is created in blocking mode since
+ * io_uring takes care of the asynchronous execution.
+ */
+
+static int
+uring_connect(happy_t *h, target_t *tp, endpoint_t *ep)
+{
+    uring_t *u = h->uring;
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec *ts = &u->ts[u->nbatch];
+    unsigned int us = rto(h, ep);
+
+    ts->tv_sec = us / 1000000;
+    ts->tv_nsec = (us % 1000000) * 1000L;
+
+    ep->socket = pool_get(h, ep);
+    if (ep->socket < 0) {
+        ep->soerror = errno;
+        switch (errno) {
+        case EAFNOSUPPORT:
+        case EPROTONOSUPPORT:
+            ep->socket = 0;
+            return -1;
+        default:
+            fprintf(stderr, "%s: socket: %s (skipping %s port %s)\n",
+                    h->progname, strerror(errno), tp->host, tp->port);
+            ep->socket = 0;
+            ep->state = EP_STATE_FAILED;
+            h->metrics.errors++;
+            return -1;
+        }
+    }
+    if (sock_bind(h, ep, ep->socket) == -1) {
+        fprintf(stderr, "%s: bind: %s (skipping %s port %s)\n",
+                h->progname, strerror(errno), tp->host, tp->port);
+        (void) close(ep->socket);
+        ep->socket = 0;
+        ep->state = EP_STATE_FAILED;
+        h->metrics.errors++;
+        return -1;
+    }
+
+    sqe = uring_sqe(h);
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = ep->socket;
+    sqe->addr = (uintptr_t) &ep->addr;
+    sqe->off = ep->addrlen;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uintptr_t) ep;
+
+    sqe = uring_sqe(h);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) ts;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t) ep | URING_UD_TIMEOUT;
+
+    ep->state = EP_STATE_CONNECTING;
+    u->batch[u->nbatch++] = ep;
+    u->inflight++;
+    h->fd_inflight++;
+    h->metrics.started++;
+    return 0;
+}
+
+/*
+ * Run one round of connection attempts to all endpoints using the
+ * io_uring. With a delay, each connect is submitted in its own pacing
+ * slot, which is timed by a timeout request on the ring itself;
+ * without a delay, connects are submitted in batches.
+ */
+
+static void
+uring_probe(happy_t *h)
+{
+    uring_t *u = h->uring;
+    struct io_uring_sqe *sqe;
+    target_t *tp;
+    endpoint_t *ep;
+
+    u->pacer.tv_sec = h->delay / 1000;
+    u->pacer.tv_nsec = (h->delay % 1000) * 1000000L;
+
+    h->metrics.backlog = 0;
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            h->metrics.backlog++;
+        }
+    }
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep);
+             ep++, h->metrics.backlog--) {
+            if (ep->state == EP_STATE_DONE || ep->dup) {
+                continue;
+            }
+            if (h->delay) {
+                sqe = uring_sqe(h);
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uintptr_t) &u->pacer;
+                sqe->len = 1;
+                sqe->user_data = URING_UD_PACER;
+                u->paced = 0;
+                do {
+                    uring_enter(h, 1);
+                    uring_reap(h);
+                } while (! u->paced);
+            } else if (u->queued + 2 > URING_ENTRIES) {
+                uring_enter(h, 0);
+                uring_reap(h);
+            }
+            if (h->delay) {
+                pool_fill(h);
+            }
+            while (h->fd_inflight + h->fd_kept >= h->fd_budget) {
+                uring_enter(h, 1);
+                uring_reap(h);
+            }
+            if (uring_connect(h, tp, ep) == 0 && h->delay) {
+                uring_enter(h, 0);
+            }
+        }
+    }
+
+    uring_enter(h, 0);
+    while (u->inflight) {
+        uring_enter(h, 1);
+        uring_reap(h);
+    }
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/*
+ * Select the engine used to run the connection attempts. Returns -1
+ * if the engine is not available, in which case the portable select()
+ * engine is used.
+ */
+
+int
+happy_engine(happy_t *h, int engine)
+{
+    h->engine = ENGINE_SELECT;
+    if (engine == ENGINE_SELECT) {
+        return 0;
+    }
+    if (h->net) {
+        /* a network backend only drives the select engine */
+        errno = ENOTSUP;
+        return -1;
+    }
+#ifdef HAVE_LINUX_IO_URING_H
+    if (engine == ENGINE_URING && (h->uring || uring_open(h) == 0)) {
+        h->engine = ENGINE_URING;
+        return 0;
+    }
+    if (engine == ENGINE_URING) {
+        return -1;
+    }
+#endif
+    errno = ENOTSUP;
+    return -1;
+}
+
+/*
+ * Only the probing rounds go through a network backend. Returns
+ * non-zero if the configuration needs the real network: sources,
+ * kept connections, TCP_INFO, TLS or a metrics listener.
+ */
+
+static int
+net_conflict(happy_t *h)
+{
+    return (h->sources || h->pmode || h->kmode || h->tmode
+            || h->metrics.fd != -1);
+}
+
+/*
+ * Set the network backend of the select engine, or go back to the
+ * system calls if net is NULL. A backend implies the select engine.
+ * Returns -1 with errno EINVAL if the backend is incomplete or the
+ * configuration cannot be simulated.
+ */
+
+int
+happy_net(happy_t *h, const happy_net_t *net)
+{
+    assert(h);
+
+    if (net && (! net->socket || ! net->connect || ! net->soerror
+                || ! net->close || ! net->select || ! net->gettimeofday
+                || net_conflict(h))) {
+        errno = EINVAL;
+        return -1;
+    }
+    h->net = net;
+    if (net) {
+        (void) happy_engine(h, ENGINE_SELECT);
+    }
+    return 0;
+}
+
+/*
+ * Restrict the local ports of all connections to the range lo..hi
+ * (-l), or lift the restriction if lo is 0. Returns -1 if the range is
+ * invalid or the kernel can not restrict the ports of a socket.
+ */
+
+int
+happy_ports(happy_t *h, unsigned int lo, unsigned int hi)
+{
+    int fd, rc;
+
+    assert(h);
+
+    if (lo > hi || hi > 65535) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (lo) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) {
+            return -1;
+        }
+        rc = port_range(fd, lo, hi);
+        (void) close(fd);
+        if (rc == -1) {
+            return -1;
+        }
+    }
+    h->port_lo = lo;
+    h->port_hi = hi;
+    return 0;
+}
+
+/*
+ * Raise the soft limit on open files up to the hard limit and derive
+ * the budget of sockets in flight from it, leaving room for the other
+ * descriptors we use. The select engine can only handle descriptors
+ * below FD_SETSIZE.
+ */
+
+static void
+fd_limit(happy_t *h)
+{
+    struct rlimit rl;
+    rlim_t cur, max = RLIM_INFINITY;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        cur = rl.rlim_cur;
+        if (rl.rlim_cur != rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+                rl.rlim_cur = cur;
+            }
+        }
+        max = rl.rlim_cur;
+    }
+    if (h->engine == ENGINE_SELECT
+        && (max == RLIM_INFINITY || max > FD_SETSIZE)) {
+        max = FD_SETSIZE;
+    }
+    if (max == RLIM_INFINITY || max > INT_MAX) {
+        max = INT_MAX;
+    }
+    h->fd_budget = (max > 2 * FD_RESERVED) ? max - FD_RESERVED : max / 2;
+}
+
+/*
+ * Deduplicate endpoints across targets (-u). Endpoints with the same
+ * socket address, socket type and source as an earlier endpoint are
+ * marked as duplicates; they are not probed and get the samples of
+ * the earlier endpoint after each round. The endpoints are found with
+ * a temporary open addressing hash table.
+ */
+
+static unsigned int
+dedup_hash(endpoint_t *ep)
+{
+    unsigned int i, h = 2166136261u;
+    const unsigned char *p = (const unsigned char *) &ep->addr;
+
+    for (i = 0; i < ep->addrlen; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h ^ ep->socktype ^ (unsigned int) (uintptr_t) ep->source;
+}
+
+static void
+dedup(happy_t *h)
+{
+    unsigned int n = 0, size, i;
+    endpoint_t **table;
+    target_t *tp;
+    endpoint_t *ep, *op;
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        n += tp->num_endpoints;
+    }
+    for (size = 16; size < 2 * n; size *= 2) ;
+    table = happy_calloc(size, sizeof(*table));
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            for (i = dedup_hash(ep) & (size - 1); (op = table[i]);
+                 i = (i + 1) & (size - 1)) {
+                if (op->addrlen == ep->addrlen
+                    && op->socktype == ep->socktype
+                    && op->source == ep->source
+                    && memcmp(&op->addr, &ep->addr, ep->addrlen) == 0) {
+                    ep->dup = op;
+                    break;
+                }
+            }
+            if (! op) {
+                table[i] = ep;
+            }
+        }
+    }
+    free(table);
+}
+
+/*
+ * Copy the samples of the probed endpoints to their duplicates. New
+ * samples are handed to the sample callback as if they were taken for
+ * the duplicate.
+ */
+
+static void
+dedup_fanout(happy_t *h)
+{
+    target_t *tp;
+    endpoint_t *ep, *op;
+    unsigned int idx;
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (! (op = ep->dup)) {
+                continue;
+            }
+            idx = ep->idx;
+            memcpy(ep->values, op->values, op->idx * sizeof(*ep->values));
+            if (ep->ki_values) {
+                memcpy(ep->ki_values, op->ki_values,
+                       op->idx * sizeof(*ep->ki_values));
+            }
+            ep->sum = op->sum;
+            ep->tot = op->tot;
+            ep->idx = op->idx;
+            ep->cnt = op->cnt;
+            ep->soerror = op->soerror;
+            for (; h->sample && idx < ep->idx; idx++) {
+                h->sample(h, tp, ep, ep->values[idx], h->arg);
+            }
+        }
+    }
+}
+
+/*
+ * Prepare the targets for probing once all of them have been added:
+ * derive the socket budget, allocate the sample arrays and find the
+ * endpoints shared by several targets (umode). With ci_pct set, each
+ * endpoint is sampled until its confidence interval is narrow enough
+ * but at most nsamples (default 10 * nqueries) times. Returns -1
+ * with errno EINVAL if a network backend is set together with
+ * options it cannot simulate.
+ */
+
+int
+happy_setup(happy_t *h)
+{
+    target_t *tp;
+    endpoint_t *ep;
+
+    assert(h);
+
+    if (h->net && net_conflict(h)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd_limit(h);
+
+    if (! h->ci_pct) {
+        h->nsamples = h->nqueries;
+    } else if (h->nsamples < h->nqueries) {
+        h->nsamples = h->nsamples ? h->nqueries : 10 * h->nqueries;
+    }
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            ep->values = happy_calloc(h->nsamples, sizeof(unsigned int));
+            if (h->kmode) {
+                ep->ki_values = happy_calloc(h->nsamples, sizeof(kinfo_t));
+            }
+        }
+    }
+    if (h->umode) {
+        dedup(h);
+    }
+    return 0;
+}
+
+/*
+ * Start a round of connection attempts to all endpoints with the
+ * select engine. The round is driven by happy_fdset() and
+ * happy_process(), so that it can run on the event loop of the
+ * caller. Returns -1 if another engine has been selected.
+ */
+
+int
+happy_start(happy_t *h)
+{
+    target_t *tp;
+    endpoint_t *ep;
+    struct timeval tv, dd;
+
+    assert(h);
+
+    if (h->engine != ENGINE_SELECT) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    pool_want(h);
+
+    h->metrics.backlog = 0;
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            h->metrics.backlog++;
+        }
+    }
+
+    h->cur_tp = h->targets;
+    h->cur_ep = target_valid(h->cur_tp) ? h->cur_tp->endpoints : NULL;
+    round_seek(h);
+
+    dd.tv_sec = h->delay / 1000;
+    dd.tv_usec = (h->delay % 1000) * 1000;
+    (void) net_time(h, &tv);
+    timeradd(&tv, &dd, &h->slot);
+    return 0;
+}
+
+/*
+ * Add the sockets of the current round to the descriptor sets and
+ * leave the time until happy_process() has to be called again in the
+ * struct timeval. Returns the highest descriptor in the sets, max if
+ * that is higher.
+ */
+
+int
+happy_fdset(happy_t *h, int max, fd_set *rfds, fd_set *wfds,
+            struct timeval *to)
+{
+    int n, due = 0;
+    struct timeval tn, td;
+
+    assert(h && rfds && wfds && to);
+
+    n = generate_fdset(h, rfds, wfds, h->timeout ? &td : NULL);
+    if (n != -1 && h->timeout) {
+        due = 1;
+    }
+    if (target_valid(h->cur_tp) && ! budget_full(h)
+        && (! due || timercmp(&h->slot, &td, <))) {
+        td = h->slot;
+        due = 1;
+    }
+
+    if (due) {
+        (void) net_time(h, &tn);
+        if (timercmp(&td, &tn, <)) {
+            td = tn;
+        }
+        timersub(&td, &tn, to);
+    } else {
+        /* nothing times out, check back once a second */
+        to->tv_sec = 1;
+        to->tv_usec = 0;
+    }
+
+    return metrics_fdset(h, rfds, n > max ? n : max);
+}
+
+/*
+ * Record the results of the sockets found ready in the descriptor
+ * sets, check for timeouts and start the connect()s that are due.
+ * Returns 0 once the round is complete.
+ */
+
+int
+happy_process(happy_t *h, fd_set *rfds, fd_set *wfds)
+{
+    assert(h && rfds && wfds);
+
+    metrics_serve(h, rfds);
+    update(h, rfds, wfds);
+    prepare(h);
+    if (target_valid(h->cur_tp) || h->fd_inflight) {
+        return 1;
+    }
+    if (h->umode) {
+        dedup_fanout(h);
+    }
+    return 0;
+}
+
+/*
+ * Run one round of connection attempts to all endpoints with the
+ * selected engine and wait until it is complete.
+ */
+
+void
+happy_probe(happy_t *h)
+{
+    int rc, max;
+    fd_set rfds, wfds;
+    struct timeval to;
+    instr_mark_t m;
+
+    assert(h);
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (h->engine == ENGINE_URING) {
+        pool_want(h);
+        uring_probe(h);
+        if (h->umode) {
+            dedup_fanout(h);
+        }
+        return;
+    }
+#endif
+    (void) happy_start(h);
+    do {
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        max = happy_fdset(h, -1, &rfds, &wfds, &to);
+        instr_begin(h, &m);
+        rc = net_select(h, 1 + max, &rfds, &wfds, &to);
+        instr_end(h, INSTR_PHASE_SELECT, &m);
+        instr_select_return(h);
+        if (rc == -1) {
+            fprintf(stderr, "%s: select failed: %s\n",
+                    h->progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } while (happy_process(h, &rfds, &wfds));
+}
+
+/*
+ * Two-sided 95% quantiles of the t distribution for 1..10 degrees of
+ * freedom; larger sample sizes use the (conservative) last entry.
+ */
+
+static const double t95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228
+};
+
+/*
+ * Check whether an endpoint needs no further samples (-C): it reached
+ * the sample cap, it never connected and failed hard, or the 95%
+ * confidence interval of its mean is within ci_pct percent of the mean.
+ */
+
+static int
+converged(happy_t *h, endpoint_t *ep)
+{
+    unsigned int i, df;
+    double mean, var, t, d;
+
+    if (ep->idx >= h->nsamples) {
+        return 1;
+    }
+    if (! ep->tot) {
+        switch (ep->soerror) {
+        case ECONNREFUSED:
+        case ETIMEDOUT:
+        case ENETUNREACH:
+        case EHOSTUNREACH:
+        case ENETDOWN:
+        case EHOSTDOWN:
+        case EAFNOSUPPORT:
+        case EPROTONOSUPPORT:
+            return 1;
+        }
+        return 0;
+    }
+    if (ep->tot < h->nqueries || ep->tot < 2) {
+        return 0;
+    }
+
+    mean = (double) ep->sum / ep->tot;
+    for (i = 0, var = 0; i < ep->idx; i++) {
+        if (ep->values[i] >= 0) {
+            d = ep->values[i] - mean;
+            var += d * d;
+        }
+    }
+    df = ep->tot - 1;
+    var /= df;
+    t = t95[df <= 10 ? df - 1 : 9];
+    d = mean * h->ci_pct / 100;
+    return t * t * var / ep->tot <= d * d;
+}
+
+/*
+ * Mark the endpoints that need no further samples as done and return
+ * the number of endpoints that are still sampled.
+ */
+
+int
+happy_adapt(happy_t *h)
+{
+    target_t *tp;
+    endpoint_t *ep;
+    int n = 0;
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (ep->state == EP_STATE_DONE || ep->dup) {
+                continue;
+            }
+            if (converged(h, ep)) {
+                ep->state = EP_STATE_DONE;
+            } else {
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * Sort the results for each target. This is in particular useful for
+ * interactive usage.
+ */
+
+static int
+cmp(const void *a, const void *b)
+{
+    endpoint_t *pa = (endpoint_t *) a;
+    endpoint_t *pb = (endpoint_t *) b;
+
+    if (! pa->tot || ! pb->tot) {
+        return 0;
+    }
+
+    if (pa->sum/pa->tot < pb->sum/pb->tot) {
+        return -1;
+    } else if (pa->sum/pa->tot > pb->sum/pb->tot) {
+        return 1;
+    }
+    return 0;
+}
+
+void
+happy_sort(happy_t *h)
+{
+    target_t *tp;
+    endpoint_t *ep;
+
+    assert(h);
+
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        if (tp->endpoints) {
+            qsort(tp->endpoints, tp->num_endpoints, sizeof(*ep), cmp);
+        }
+    }
+}
+
+/*
+ * Create a new instance with the default configuration.
+ */
+
+happy_t *
+happy_new(void)
+{
+    happy_t *h;
+
+    h = happy_calloc(1, sizeof(happy_t));
+    h->progname = "happy";
+    h->nqueries = 3;
+    h->timeout = 2000;
+    h->delay = 25;
+    h->pump_timeout = 2000;
+    h->nstreams = 1;
+    h->engine = ENGINE_SELECT;
+    h->pools[0].family = AF_INET;
+    h->pools[1].family = AF_INET6;
+    h->metrics.fd = -1;
+    return h;
+}
+
+/*
+ * Cleanup targets and release all data structures of an instance.
+ */
+
+void
+happy_free(happy_t *h)
+{
+    target_t *tp, *np;
+    endpoint_t *ep;
+    source_t *src;
+
+    if (! h) {
+        return;
+    }
+
+    for (tp = h->targets; target_valid(tp); tp = np) {
+	np = tp->next;
+	for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+	    if (ep->socket) {
+		(void) net_close(h, ep->socket);
+	    }
+	    if (ep->conn) {
+		sock_close(h, ep->conn);
+	    }
+	    if (ep->values) {
+		(void) free(ep->values);
+	    }
+	    if (ep->ki_values) {
+		(void) free(ep->ki_values);
+	    }
+	    if (ep->streams) {
+		(void) free(ep->streams);
+	    }
+#ifdef HAVE_OPENSSL
+	    if (ep->ssl) {
+		SSL_free(ep->ssl);
+	    }
+	    if (ep->session) {
+		SSL_SESSION_free(ep->session);
+	    }
+	    if (ep->hs_values) {
+		(void) free(ep->hs_values);
+		(void) free(ep->hs_resumed);
+	    }
+#endif
+	    if (ep->canonname) {
+		(void) free(ep->canonname);
+	    }
+	    if (ep->reversename) {
+		(void) free(ep->reversename);
+	    }
+	}
+	if (tp->endpoints) (void) free(tp->endpoints);
+	if (tp->host) (void) free(tp->host);
+	if (tp->port) (void) free(tp->port);
+	(void) free(tp);
+    }
+
+    while (h->sources) {
+        src = h->sources->next;
+        free(h->sources->name);
+        free(h->sources->tag);
+        free(h->sources->field);
+        free(h->sources);
+        h->sources = src;
+    }
+
+    pool_drain(h);
+    metrics_close(h);
+#ifdef HAVE_LINUX_IO_URING_H
+    uring_close(h);
+#endif
+#ifdef HAVE_OPENSSL
+    if (h->tls_ctx) {
+        SSL_CTX_free(h->tls_ctx);
+    }
+#endif
+    free(h);
+}
+
+
+/*
+ * Wait until the socket becomes writable (or readable) or the timeout
+ * measured from ts expires. Returns 1 if the socket is ready, 0 on a
+ * timeout.
+ */
+
+static int
+sock_wait(happy_t *h, int fd, int wr, struct timeval *ts)
+{
+    int rc;
+    fd_set fdset, rfds;
+    struct timeval to, tn;
+
+    while (1) {
+        FD_ZERO(&fdset);
+        FD_SET(fd, &fdset);
+        FD_ZERO(&rfds);
+        if (! wr) {
+            FD_SET(fd, &rfds);
+        }
+        to.tv_sec = h->timeout / 1000;
+        to.tv_usec = (h->timeout % 1000) * 1000;
+        (void) gettimeofday(&tn, NULL);
+        timeradd(ts, &to, &to);
+        if (timercmp(&tn, &to, >=)) {
+            return 0;
+        }
+        timersub(&to, &tn, &to);
+        rc = select(1 + metrics_fdset(h, &rfds, fd), &rfds,
+                    wr ? &fdset : NULL, NULL, &to);
+        if (rc == -1) {
+            fprintf(stderr, "%s: select failed: %s\n",
+                    h->progname, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        metrics_serve(h, &rfds);
+        if (FD_ISSET(fd, wr ? &fdset : &rfds)) {
+            return 1;
+        }
+    }
+}
+
+/*
+ * Open a fresh connection to an endpoint for happy_pump() if no
+ * connection was kept from the probing rounds. Returns -1 on failure.
+ */
+
+static int
+pump_connect(happy_t *h, endpoint_t *ep)
+{
+    int fd, soerror;
+    socklen_t soerrorlen = sizeof(soerror);
+    struct timeval ts;
+
+    fd = sock_open(ep->family, ep->socktype, ep->protocol, 1);
+    if (fd < 0) {
+        return -1;
+    }
+    (void) gettimeofday(&ts, NULL);
+    if (sock_bind(h, ep, fd) == -1
+        || (connect(fd, (struct sockaddr *) &ep->addr, ep->addrlen) == -1
+            && errno != EINPROGRESS)
+        || ! sock_wait(h, fd, 1, &ts)
+        || getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerror, &soerrorlen) == -1
+        || soerror) {
+        (void) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Upload mode (-U): instead of GET requests, every connection sends a
+ * single POST request with a body that does not end before the pump
+ * timeout. The body is sent from one buffer with MSG_ZEROCOPY where
+ * the kernel supports it, so the upload is not limited by copying.
+ * The buffer is never modified, so it can be reused before the kernel
+ * has signalled completion; the notifications are drained from the
+ * error queue of the socket.
+ */
+
+#define PUMP_BODY		65536
+
+static void
+pump_zerocopy(stream_t *sp)
+{
+#ifdef SO_ZEROCOPY
+    int one = 1;
+
+    sp->zerocopy = (setsockopt(sp->conn, SOL_SOCKET, SO_ZEROCOPY,
+                               &one, sizeof(one)) == 0);
+#endif
+}
+
+static void
+pump_reap(stream_t *sp)
+{
+    char control[256];
+    struct msghdr mh;
+
+    do {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+    } while (recvmsg(sp->conn, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) != -1);
+}
+
+/*
+ * Delimit the HTTP responses in the data received on a pumped
+ * connection, so that requests can be pipelined up to a fixed depth
+ * (-w). Bodies are delimited by Content-Length, by chunked transfer
+ * encoding or by the end of the connection. http_line() handles a
+ * complete line of the status, header, chunk size or trailer and
+ * returns 1 if it completed a response.
+ */
+
+enum {
+    HTTP_STATUS = 0,
+    HTTP_HEADER,
+    HTTP_BODY,
+    HTTP_CHUNK,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_END,
+    HTTP_TRAILER,
+    HTTP_EOF
+};
+
+static int
+http_line(http_t *hp)
+{
+    char *p = hp->line;
+
+    switch (hp->state) {
+    case HTTP_STATUS:
+        if (! *p) {
+            return 0;
+        }
+        p = strchr(p, ' ');
+        hp->status = (strncmp(hp->line, "HTTP/", 5) == 0 && p) ? atoi(p) : 0;
+        hp->chunked = 0;
+        hp->length = 0;
+        hp->left = 0;
+        hp->state = HTTP_HEADER;
+        return 0;
+
+    case HTTP_HEADER:
+        if (strncasecmp(p, "Content-Length:", 15) == 0) {
+            hp->left = strtoull(p + 15, NULL, 10);
+            hp->length = 1;
+        } else if (strncasecmp(p, "Transfer-Encoding:", 18) == 0
+                   && strcasestr(p + 18, "chunked")) {
+            hp->chunked = 1;
+        }
+        if (*p) {
+            return 0;
+        }
+        if (hp->status / 100 == 1) {
+            /* an interim response, the final one follows */
+            hp->state = HTTP_STATUS;
+            return 0;
+        }
+        if (hp->status == 204 || hp->status == 304
+            || (hp->length && ! hp->left && ! hp->chunked)) {
+            hp->state = HTTP_STATUS;
+            return 1;
+        }
+        hp->state = hp->chunked ? HTTP_CHUNK
+            : hp->length ? HTTP_BODY : HTTP_EOF;
+        return 0;
+
+    case HTTP_CHUNK:
+        hp->left = strtoull(p, NULL, 16);
+        hp->state = hp->left ? HTTP_CHUNK_DATA : HTTP_TRAILER;
+        return 0;
+
+    case HTTP_CHUNK_END:
+        hp->state = HTTP_CHUNK;
+        return 0;
+
+    case HTTP_TRAILER:
+        if (*p) {
+            return 0;
+        }
+        hp->state = HTTP_STATUS;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Feed received data to the parser. Returns the number of responses
+ * completed by the data.
+ */
+
+static unsigned int
+http_parse(http_t *hp, const char *buf, size_t len)
+{
+    unsigned int done = 0;
+    size_t n;
+    char c;
+
+    while (len) {
+        if (hp->state == HTTP_EOF) {
+            break;
+        }
+        if (hp->state == HTTP_BODY || hp->state == HTTP_CHUNK_DATA) {
+            n = (len < hp->left) ? len : hp->left;
+            buf += n;
+            len -= n;
+            hp->left -= n;
+            if (! hp->left && hp->state == HTTP_BODY) {
+                hp->state = HTTP_STATUS;
+                done++;
+            } else if (! hp->left) {
+                hp->state = HTTP_CHUNK_END;
+            }
+            continue;
+        }
+        c = *buf++;
+        len--;
+        if (c != '\n') {
+            /* overlong lines are cut, we only need their beginning */
+            if (hp->len < sizeof(hp->line) - 1) {
+                hp->line[hp->len++] = c;
+            }
+            continue;
+        }
+        if (hp->len && hp->line[hp->len - 1] == '\r') {
+            hp->len--;
+        }
+        hp->line[hp->len] = '\0';
+        hp->len = 0;
+        done += http_line(hp);
+    }
+    return done;
+}
+
+/*
+ * Check whether a pumped connection has something to send: always
+ * with -U and without a depth, else the rest of a request or a new
+ * request if fewer than depth are outstanding.
+ */
+
+static int
+pump_ready(happy_t *h, stream_t *sp, const char *body)
+{
+    return body || ! h->depth || sp->hdr || sp->outstanding < h->depth;
+}
+
+/*
+ * Send the next chunk of the request: the rest of the current request,
+ * or with a body the rest of its header and then the body.
+ */
+
+static ssize_t
+pump_send(stream_t *sp, const char *msg, const char *body)
+{
+    size_t len = strlen(msg);
+    ssize_t sent;
+
+    if (! body) {
+        sent = send(sp->conn, msg + sp->hdr, len - sp->hdr, MSG_NOSIGNAL);
+        if (sent > 0) {
+            sp->hdr += sent;
+            if (sp->hdr == len) {
+                sp->hdr = 0;
+                sp->outstanding++;
+            }
+        }
+        return sent;
+    }
+    if (sp->hdr < len) {
+        sent = send(sp->conn, msg + sp->hdr, len - sp->hdr, MSG_NOSIGNAL);
+        if (sent > 0) {
+            sp->hdr += sent;
+        }
+        return sent;
+    }
+    sent = send(sp->conn, body, PUMP_BODY,
+                MSG_NOSIGNAL | (sp->zerocopy ? MSG_ZEROCOPY : 0));
+    if (sent == -1 && errno == ENOBUFS) {
+        /* too many zerocopy sends in flight, retry when reaped */
+        return 0;
+    }
+    return sent;
+}
+
+/*
+ * Receive and send on a pumped connection, whichever it is ready
+ * for. Returns -1 if the peer has gone away.
+ */
+
+static int
+pump_io(happy_t *h, target_t *tp, stream_t *sp, const char *msg,
+        const char *body, fd_set *rfds, fd_set *wfds)
+{
+    char buffer[8192];
+    ssize_t sent, received;
+    unsigned int done;
+
+    if (FD_ISSET(sp->conn, rfds)) {
+        if (sp->zerocopy) {
+            pump_reap(sp);
+        }
+        received = recv(sp->conn, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if(received<0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "recverr (%s): %s\n", tp->host, strerror(errno));
+            }
+            if (errno == EPIPE) return -1;
+        } else if (received == 0) {
+            /* the end of a body delimited by the connection */
+            if (sp->http.state == HTTP_EOF) {
+                sp->responses++;
+            }
+            return -1;
+        } else {
+            sp->rcvd += received;
+            h->metrics.rcvd += received;
+            done = http_parse(&sp->http, buffer, received);
+            sp->responses += done;
+            sp->outstanding -= (done < sp->outstanding) ? done
+                : sp->outstanding;
+        }
+    }
+
+    if (FD_ISSET(sp->conn, wfds)) {
+        sent = pump_send(sp, msg, body);
+        if(sent<0) {
+            fprintf(stderr, "senderr (%s): %s\n", tp->host, strerror(errno));
+            if (errno == EPIPE) return -1;
+        } else {
+            sp->send += sent;
+            h->metrics.send += sent;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Close a pumped connection and add its results to the endpoint.
+ */
+
+static void
+pump_close(happy_t *h, endpoint_t *ep, stream_t *sp)
+{
+    if (h->kmode) {
+        kinfo_pump(sp);
+    }
+    if (h->upmode) {
+        kinfo_acked(sp);
+    }
+    sock_close(h, sp->conn);
+    sp->conn = 0;
+
+    ep->send += sp->send;
+    ep->rcvd += sp->rcvd;
+    ep->responses += sp->responses;
+    ep->ki_rate += sp->ki_rate;
+    ep->ki_retrans += sp->ki_retrans;
+}
+
+/*
+ * Pump connections with HTTP GET requests and measure the datarate
+ * (throughput) of the stream of responses, or with -U the datarate of
+ * an endless POST request. Requests are pipelined until the socket
+ * buffers are full, or with a depth (-w) until that many are waiting
+ * for their response. All nstreams connections of an endpoint
+ * (-P) are pumped at the same time, the first one is the connection
+ * kept from the probing rounds if there is one.
+ */
+
+void
+happy_pump(happy_t *h)
+{
+    static char const template[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "User-Agent: pump/0.1\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: Keep-Alive\r\n"
+    "\r\n";
+
+    static char const upload[] =
+    "POST / HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "User-Agent: pump/0.1\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: 1099511627776\r\n"
+    "\r\n";
+
+    char *msg, *body = NULL;
+    target_t *tp, *np;
+    endpoint_t *ep;
+    stream_t *sp;
+    struct timeval ts, tn, td, to;
+    fd_set rfds, wfds;
+    unsigned int us;
+    int i, rc, max, live;
+
+    assert(h && h->nstreams > 0);
+
+    if (h->upmode) {
+        body = happy_calloc(1, PUMP_BODY);
+        memset(body, 'x', PUMP_BODY);
+    }
+
+    for (tp = h->targets; target_valid(tp); tp = np) {
+        np = tp->next;
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (! ep->conn && ! ep->tot) {
+                continue;
+            }
+            if (asprintf(&msg, body ? upload : template, tp->host) == -1) {
+                fprintf(stderr, "%s: malloc failed for %s\n",
+                        h->progname, tp->host);
+                continue;
+            }
+
+            if (! ep->streams) {
+                ep->streams = happy_calloc(h->nstreams, sizeof(stream_t));
+            }
+            for (i = 0, live = 0; i < h->nstreams; i++) {
+                sp = &ep->streams[i];
+                if (ep->conn) {
+                    sp->conn = ep->conn;
+                    ep->conn = 0;
+                    h->fd_kept--;
+                } else {
+                    /* no connection kept from the probing rounds */
+                    sp->conn = pump_connect(h, ep);
+                    if (sp->conn < 0) {
+                        fprintf(stderr, "%s: connect failed for %s\n",
+                                h->progname, tp->host);
+                        sp->conn = 0;
+                        continue;
+                    }
+                }
+                sp->hdr = 0;
+                sp->outstanding = 0;
+                memset(&sp->http, 0, sizeof(sp->http));
+                if (body) {
+                    pump_zerocopy(sp);
+                }
+                live++;
+            }
+
+            (void) gettimeofday(&ts, NULL);
+            us = 0;
+            while (live && us < h->pump_timeout * 1000) {
+                FD_ZERO(&rfds);
+                FD_ZERO(&wfds);
+                for (i = 0, max = -1; i < h->nstreams; i++) {
+                    sp = &ep->streams[i];
+                    if (sp->conn) {
+                        FD_SET(sp->conn, &rfds);
+                        if (pump_ready(h, sp, body)) {
+                            FD_SET(sp->conn, &wfds);
+                        }
+                        if (sp->conn > max) {
+                            max = sp->conn;
+                        }
+                    }
+                }
+                /* a silent peer must not outlast the pump timeout */
+                us = h->pump_timeout * 1000 - us;
+                to.tv_sec = us / 1000000;
+                to.tv_usec = us % 1000000;
+                rc = select(1 + metrics_fdset(h, &rfds, max),
+                            &rfds, &wfds, NULL, &to);
+                if (rc == -1) {
+                    fprintf(stderr, "%s: select failed: %s\n",
+                            h->progname, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                metrics_serve(h, &rfds);
+
+                for (i = 0; i < h->nstreams; i++) {
+                    sp = &ep->streams[i];
+                    if (sp->conn
+                        && pump_io(h, tp, sp, msg, body, &rfds, &wfds) == -1) {
+                        pump_close(h, ep, sp);
+                        live--;
+                    }
+                }
+
+                (void) gettimeofday(&tn, NULL);
+                timersub(&tn, &ts, &td);
+                us = td.tv_sec*1000000 + td.tv_usec;
+            }
+
+            for (i = 0; i < h->nstreams; i++) {
+                if (ep->streams[i].conn) {
+                    pump_close(h, ep, &ep->streams[i]);
+                }
+            }
+
+            free(msg);
+        }
+    }
+
+    free(body);
+}
+
+#ifdef MSG_FASTOPEN
+
+/*
+ * Send a request to an endpoint and measure the time until the first
+ * byte of the response arrives. With tfo set, the request is sent
+ * with the SYN using TCP Fast Open (MSG_FASTOPEN) if the kernel has a
+ * cookie for the endpoint; otherwise a regular connect() is used.
+ * Returns the time to first byte in us or -1 on failure.
+ */
+
+static int
+fastopen_probe(happy_t *h, endpoint_t *ep, const char *msg, int tfo)
+{
+    int fd, n, soerror;
+    size_t sent = 0, syn = 0, len = strlen(msg);
+    socklen_t soerrorlen = sizeof(soerror);
+    struct tcp_info ti;
+    socklen_t tilen = sizeof(ti);
+    struct timeval ts, tn, td;
+    char c;
+
+    fd = sock_open(ep->family, ep->socktype, ep->protocol, 1);
+    if (fd < 0) {
+        return -1;
+    }
+    if (sock_bind(h, ep, fd) == -1) {
+        goto fail;
+    }
+
+    (void) gettimeofday(&ts, NULL);
+    if (tfo) {
+        n = sendto(fd, msg, len, MSG_FASTOPEN | MSG_NOSIGNAL,
+                   (struct sockaddr *) &ep->addr, ep->addrlen);
+        if (n > 0) {
+            sent = syn = n;
+        } else if (errno != EINPROGRESS) {
+            goto fail;
+        }
+    } else {
+        n = connect(fd, (struct sockaddr *) &ep->addr, ep->addrlen);
+        if (n == -1 && errno != EINPROGRESS) {
+            goto fail;
+        }
+    }
+
+    if (! sock_wait(h, fd, 1, &ts)
+        || getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerror, &soerrorlen) == -1
+        || soerror) {
+        goto fail;
+    }
+    while (sent < len) {
+        n = send(fd, msg + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno != EAGAIN || ! sock_wait(h, fd, 1, &ts)) {
+                goto fail;
+            }
+            continue;
+        }
+        sent += n;
+    }
+
+    if (! sock_wait(h, fd, 0, &ts) || recv(fd, &c, 1, 0) != 1) {
+        goto fail;
+    }
+    (void) gettimeofday(&tn, NULL);
+
+    if (tfo && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &tilen) == 0) {
+        if (ti.tcpi_options & TCPI_OPT_SYN_DATA) {
+            ep->fo_acked++;
+        }
+    }
+    if (syn) {
+        ep->fo_syn++;
+    }
+
+    sock_close(h, fd);
+    timersub(&tn, &ts, &td);
+    return td.tv_sec * 1000000 + td.tv_usec;
+
+fail:
+    (void) close(fd);
+    return -1;
+}
+
+/*
+ * Measure the time to first response byte for all endpoints, once
+ * with a regular connect() and once with TCP Fast Open, so that the
+ * round trip saved by TFO can be compared. An initial TFO connection
+ * to each endpoint obtains the cookie and is not measured.
+ */
+
+int
+happy_fastopen(happy_t *h)
+{
+    static char const template[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "User-Agent: happy\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+    char *msg;
+    int i, k, us;
+    target_t *tp;
+    endpoint_t *ep;
+
+    assert(h);
+
+    if (h->net) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    for (tp = h->targets; target_valid(tp); tp = tp->next) {
+        if (asprintf(&msg, template, tp->host) == -1) {
+            fprintf(stderr, "%s: memory allocation failure\n", h->progname);
+            exit(EXIT_FAILURE);
+        }
+        for (ep = tp->endpoints; endpoint_valid(ep); ep++) {
+            if (ep->socktype != SOCK_STREAM || (ep->cnt && ! ep->tot)) {
+                continue;
+            }
+            (void) fastopen_probe(h, ep, msg, 1);
+            ep->fo_syn = ep->fo_acked = 0;
+            for (i = 0; i < h->nqueries; i++) {
+                for (k = FO_PLAIN; k <= FO_TFO; k++) {
+                    us = fastopen_probe(h, ep, msg, k == FO_TFO);
+                    if (us >= 0) {
+                        ep->fo_sum[k] += us;
+                        ep->fo_tot[k]++;
+                    }
+                }
+            }
+        }
+        free(msg);
+    }
+    return 0;
+}
+
+#else
+
+int
+happy_fastopen(happy_t *h)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif /* MSG_FASTOPEN */
+